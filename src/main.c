@@ -1,8 +1,49 @@
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#define _FILE_OFFSET_BITS 64
 #include <curses.h>
 #if defined(WIN32) || defined(__DOS__)
 #include <io.h>
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#endif
+#define HAVE_PREAD 1
+#define HAVE_MMAP 1
+#if defined(__linux__) && defined(__GLIBC__) \
+    && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE 1
+#endif
+#if defined(__GLIBC__)
+#define HAVE_MEMRCHR 1
+#endif
+#endif
+#if defined(HAVE_PTHREAD)
+#include <pthread.h>
+#endif
+#if defined(HAVE_IO_URING)
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+// Code for AVX2 is compiled in besides, and used where the CPU has it.
+#if defined(HAVE_SSE2) && defined(__GNUC__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2 1
+#include <immintrin.h>
 #endif
 #include <stdlib.h>
 #include <stdio.h>
@@ -21,317 +62,6435 @@
     (((a) < (b)) ? (a) : (b))
 #endif
 
-#if !defined(max)
-#define max(a, b) \
-    (((a) > (b)) ? (a) : (b))
-#endif
+#if !defined(max)
+#define max(a, b) \
+    (((a) > (b)) ? (a) : (b))
+#endif
+
+#define KEY_ESC 27
+#define KEY_CTRL(x) ((x) > 60 ? (x)-0x60 : (x)-0x40)
+
+// Terminals in bracketed paste mode enclose pasted text in these, which
+// ncurses can be taught to report as keys.
+#if defined(NCURSES_VERSION)
+#define HAVE_BRACKETED_PASTE 1
+#define KEY_PASTE_START (KEY_MAX + 1)
+#define KEY_PASTE_END (KEY_MAX + 2)
+#endif
+
+// File offsets are 64 bits wide wherever the platform can address that much,
+// independent of the width of pointers.
+#if defined(__DOS__)
+typedef unsigned long offset_t;
+#define OFFSET_FORMAT "lX"
+#define strtooffset strtoul
+#define fseeko fseek
+#define ftello ftell
+#else
+typedef unsigned long long offset_t;
+#define OFFSET_FORMAT "llX"
+#define strtooffset strtoull
+#if defined(WIN32)
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#endif
+#endif
+
+// Thin layer over the platform's file I/O: positional pread()/pwrite()
+// straight into the caller's memory where available, stdio elsewhere.
+struct io
+{
+#if defined(HAVE_PREAD)
+    int fd;
+    int direct;   // Bypasses the system's cache, see IO_DIRECT.
+    char* path;   // Where the file really is, for replacing it.
+#else
+    FILE* file;
+#endif
+    int readonly;
+    size_t align; // Transfers must cover whole blocks of this size.
+};
+
+#if defined(HAVE_PREAD)
+#define IO_CLOSED { -1, 0, NULL, 0, 1 }
+#else
+#define IO_CLOSED { NULL, 0, 1 }
+#endif
+
+// io_open() flags: bypass the system's cache on block devices, open for
+// reading only (also done where writing is not permitted), create.
+#define IO_DIRECT 1
+#define IO_READONLY 2
+#define IO_CREATE 4
+
+// Unaligned transfers on block devices go through a bounce buffer of this
+// size.
+#define IO_BOUNCE_SIZE (64UL*1024)
+
+int io_open(struct io* io, const char* name, int flags)
+{
+#if defined(HAVE_PREAD)
+    struct stat st;
+
+    io->direct = 0;
+    io->align = 1;
+    io->readonly = (flags & IO_READONLY) != 0;
+    if (!io->readonly)
+    {
+        io->fd = open(name, O_RDWR | (flags & IO_CREATE ? O_CREAT : 0), 0600);
+        io->readonly = io->fd == -1
+            && (errno == EACCES || errno == EPERM || errno == EROFS);
+    }
+    if (io->readonly && (io->fd = open(name, O_RDONLY)) == -1)
+    {
+        return 0;
+    }
+    if (io->fd == -1)
+    {
+        return 0;
+    }
+    // Resolved, so that replacing a symbolic link replaces its target:
+    io->path = realpath(name, NULL);
+    if (fstat(io->fd, &st) == 0 && S_ISBLK(st.st_mode))
+    {
+#if defined(BLKSSZGET)
+        int sector;
+
+        // Devices transfer whole logical sectors only:
+        if (ioctl(io->fd, BLKSSZGET, &sector) == 0 && sector > 0)
+        {
+            io->align = sector;
+        }
+#endif
+#if defined(O_DIRECT)
+        if ((flags & IO_DIRECT)
+            && fcntl(io->fd, F_SETFL, fcntl(io->fd, F_GETFL) | O_DIRECT) == 0)
+        {
+            io->direct = 1;
+        }
+#endif
+    }
+    return 1;
+#else
+    io->align = 1;
+    io->readonly = (flags & IO_READONLY) != 0;
+    if (!io->readonly)
+    {
+        io->file = fopen(name, "r+b");
+        if (io->file == NULL && (flags & IO_CREATE))
+        {
+            io->file = fopen(name, "w+b");
+        }
+        io->readonly = io->file == NULL;
+    }
+    if (io->readonly)
+    {
+        io->file = fopen(name, "rb");
+    }
+    return io->file != NULL;
+#endif
+}
+
+// Allocates memory suitable for transfers, which must be aligned like the
+// file's blocks when the system's cache is bypassed. Release with free().
+void* io_alloc(struct io* io, size_t size)
+{
+#if defined(HAVE_PREAD)
+    void* p;
+
+    if (posix_memalign(&p, max(io->align, sizeof(void*)), size) != 0)
+    {
+        return NULL;
+    }
+    return p;
+#else
+    (void)io;
+    return malloc(size);
+#endif
+}
+
+void io_close(struct io* io)
+{
+#if defined(HAVE_PREAD)
+    if (io->fd != -1)
+    {
+        close(io->fd);
+    }
+    io->fd = -1;
+    free(io->path);
+    io->path = NULL;
+#else
+    if (io->file != NULL)
+    {
+        fclose(io->file);
+    }
+    io->file = NULL;
+#endif
+}
+
+int io_size(struct io* io, offset_t* size)
+{
+#if defined(HAVE_PREAD)
+    struct stat st;
+
+    if (fstat(io->fd, &st) != 0)
+    {
+        return 0;
+    }
+#if defined(BLKGETSIZE64)
+    if (S_ISBLK(st.st_mode))
+    {
+        // Devices report no size of their own:
+        unsigned long long device_size;
+
+        if (ioctl(io->fd, BLKGETSIZE64, &device_size) != 0)
+        {
+            return 0;
+        }
+        *size = device_size;
+        return 1;
+    }
+#endif
+    *size = st.st_size;
+    return 1;
+#else
+    long long end;
+
+    if (fseeko(io->file, 0, SEEK_END) != 0 || (end = ftello(io->file)) < 0)
+    {
+        return 0;
+    }
+    *size = end;
+    return 1;
+#endif
+}
+
+#if defined(HAVE_PREAD)
+// Reads or writes exactly size bytes at offset, or fails.
+static int io_transfer(struct io* io, offset_t offset, unsigned char* data,
+        size_t size, int writing)
+{
+    while (size > 0)
+    {
+        ssize_t n = writing
+            ? pwrite(io->fd, data, size, offset)
+            : pread(io->fd, data, size, offset);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return 0;
+        }
+        data += n;
+        offset += n;
+        size -= n;
+    }
+    return 1;
+}
+
+static int io_misaligned(struct io* io, offset_t offset, const void* data,
+        size_t size)
+{
+    return offset % io->align != 0
+        || size % io->align != 0
+        || (io->direct && (size_t)data % io->align != 0);
+}
+
+// Transfers a range that is not block aligned through an aligned buffer.
+static int io_bounce(struct io* io, offset_t offset, unsigned char* data,
+        size_t size, int writing)
+{
+    size_t bounce_size = max(IO_BOUNCE_SIZE, io->align);
+    unsigned char* bounce = io_alloc(io, bounce_size);
+    int result = 0;
+
+    if (bounce == NULL)
+    {
+        return 0;
+    }
+    while (size > 0)
+    {
+        offset_t start = offset - offset % io->align;
+        size_t skew = offset - start;
+        size_t n = min(size, bounce_size - skew);
+        size_t length = (skew + n + io->align - 1) / io->align * io->align;
+
+        if ((!writing || skew != 0 || n != length)
+            && !io_transfer(io, start, bounce, length, 0))
+        {
+            goto done;
+        }
+        if (writing)
+        {
+            memcpy(&bounce[skew], data, n);
+            if (!io_transfer(io, start, bounce, length, 1))
+            {
+                goto done;
+            }
+        }
+        else
+        {
+            memcpy(data, &bounce[skew], n);
+        }
+        data += n;
+        offset += n;
+        size -= n;
+    }
+    result = 1;
+done:
+    free(bounce);
+    return result;
+}
+#endif
+
+// Reads exactly size bytes at offset, or fails.
+int io_read(struct io* io, offset_t offset, void* data, size_t size)
+{
+#if defined(HAVE_PREAD)
+    if (io_misaligned(io, offset, data, size))
+    {
+        return io_bounce(io, offset, data, size, 0);
+    }
+    return io_transfer(io, offset, data, size, 0);
+#else
+    return size == 0
+        || (fseeko(io->file, offset, SEEK_SET) == 0
+            && fread(data, size, 1, io->file) == 1);
+#endif
+}
+
+// Writes exactly size bytes at offset, or fails.
+int io_write(struct io* io, offset_t offset, const void* data, size_t size)
+{
+#if defined(HAVE_PREAD)
+    if (io_misaligned(io, offset, data, size))
+    {
+        return io_bounce(io, offset, (unsigned char*)data, size, 1);
+    }
+    return io_transfer(io, offset, (unsigned char*)data, size, 1);
+#else
+    return size == 0
+        || (fseeko(io->file, offset, SEEK_SET) == 0
+            && fwrite(data, size, 1, io->file) == 1);
+#endif
+}
+
+// Tells whether offset lies in a hole of the file, and where that ends.
+void io_extent(struct io* io, offset_t offset, offset_t filesize, int* hole,
+        offset_t* end)
+{
+#if defined(HAVE_PREAD) && defined(SEEK_HOLE)
+    off_t next = lseek(io->fd, offset, SEEK_DATA);
+
+    if (next == (off_t)-1 && errno == ENXIO)
+    {
+        // No data past offset: a hole up to the end of the file.
+        *hole = 1;
+        *end = filesize;
+        return;
+    }
+    if (next != (off_t)-1 && (offset_t)next > offset)
+    {
+        *hole = 1;
+        *end = next;
+        return;
+    }
+    next = lseek(io->fd, offset, SEEK_HOLE);
+    if (next != (off_t)-1 && (offset_t)next > offset)
+    {
+        *hole = 0;
+        *end = next;
+        return;
+    }
+#else
+    (void)io;
+    (void)offset;
+#endif
+    *hole = 0;
+    *end = filesize;
+}
+
+// Turns a range of the file into a hole. Fails where that is not supported,
+// leaving the caller to write zeros instead.
+int io_punch(struct io* io, offset_t offset, offset_t size)
+{
+#if defined(HAVE_PREAD) && defined(FALLOC_FL_PUNCH_HOLE)
+    return fallocate(io->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     offset, size) == 0;
+#else
+    (void)io;
+    (void)offset;
+    (void)size;
+    return 0;
+#endif
+}
+
+// The granularity of io_shift(): the file system's block size, or 0 where
+// ranges cannot be inserted into or collapsed out of the file.
+offset_t io_block_size(struct io* io)
+{
+#if defined(HAVE_PREAD) && defined(FALLOC_FL_INSERT_RANGE)
+    struct stat st;
+
+    if (fstat(io->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_blksize > 0)
+    {
+        return st.st_blksize;
+    }
+#else
+    (void)io;
+#endif
+    return 0;
+}
+
+// Inserts a hole of size bytes at offset, or collapses them out of the
+// file, in multiples of io_block_size(). Fails where not supported.
+int io_shift(struct io* io, offset_t offset, offset_t size, int collapse)
+{
+#if defined(HAVE_PREAD) && defined(FALLOC_FL_INSERT_RANGE)
+    return fallocate(io->fd,
+                     collapse ? FALLOC_FL_COLLAPSE_RANGE : FALLOC_FL_INSERT_RANGE,
+                     offset, size) == 0;
+#else
+    (void)io;
+    (void)offset;
+    (void)size;
+    (void)collapse;
+    return 0;
+#endif
+}
+
+// Copies between or within files without passing through memory, sharing
+// blocks where possible. Ranges within a file must not overlap.
+int io_copy(struct io* from_io, offset_t from, struct io* to_io, offset_t to,
+        offset_t size)
+{
+#if defined(HAVE_PREAD) && defined(FICLONERANGE)
+    struct file_clone_range range;
+
+    // Only ever whole blocks, or up to the end of the file:
+    range.src_fd = from_io->fd;
+    range.src_offset = from;
+    range.src_length = size;
+    range.dest_offset = to;
+    if (ioctl(to_io->fd, FICLONERANGE, &range) == 0)
+    {
+        return 1;
+    }
+#endif
+#if defined(HAVE_COPY_FILE_RANGE)
+    while (size > 0)
+    {
+        loff_t in = from;
+        loff_t out = to;
+        ssize_t done = copy_file_range(from_io->fd, &in, to_io->fd, &out,
+                                       (size_t)min(size, 1UL << 30), 0);
+        if (done <= 0)
+        {
+            return 0;
+        }
+        from += done;
+        to += done;
+        size -= done;
+    }
+    return 1;
+#else
+    (void)from_io;
+    (void)from;
+    (void)to_io;
+    (void)to;
+    (void)size;
+    return 0;
+#endif
+}
+
+// Gets everything written to the file to the disk.
+int io_sync(struct io* io)
+{
+#if defined(HAVE_PREAD)
+    return fsync(io->fd) == 0;
+#else
+    return fflush(io->file) == 0;
+#endif
+}
+
+// Tells when the file was last changed and which one it is, as far as the
+// system keeps track; 0 where it does not.
+void io_identity(struct io* io, offset_t* modified, offset_t* id)
+{
+#if defined(HAVE_PREAD)
+    struct stat st;
+
+    if (fstat(io->fd, &st) == 0)
+    {
+        *modified = (offset_t)st.st_mtime;
+        *id = (offset_t)st.st_ino;
+        return;
+    }
+#else
+    (void)io;
+#endif
+    *modified = 0;
+    *id = 0;
+}
+
+// Takes the file for this process alone, without waiting. Fails where
+// another one has it; closing the file releases it.
+int io_lock(struct io* io)
+{
+#if defined(HAVE_PREAD)
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    return fcntl(io->fd, F_SETLK, &lock) == 0;
+#else
+    (void)io;
+    return 1;
+#endif
+}
+
+// Grows (with zeros) or shrinks the file to the given size.
+int io_resize(struct io* io, offset_t size)
+{
+#if defined(HAVE_PREAD)
+    return ftruncate(io->fd, size) == 0;
+#elif defined(__DOS__)
+    return fflush(io->file) == 0 && chsize(fileno(io->file), size) == 0;
+#else
+    return fflush(io->file) == 0 && _chsize_s(_fileno(io->file), size) == 0;
+#endif
+}
+
+// Closes and removes a file from io_create_temp() that is not needed.
+void io_discard(struct io* temp)
+{
+#if defined(HAVE_PREAD)
+    if (temp->path != NULL)
+    {
+        unlink(temp->path);
+    }
+#endif
+    io_close(temp);
+}
+
+// Creates a file next to the file, with its permissions and owner, to
+// replace it with. Fails for devices, hard links and foreign owners.
+int io_create_temp(struct io* io, struct io* temp)
+{
+#if defined(HAVE_PREAD)
+    struct stat st;
+
+    if (io->path == NULL
+        || io->readonly
+        || fstat(io->fd, &st) != 0
+        || !S_ISREG(st.st_mode)
+        || st.st_nlink != 1)
+    {
+        return 0;
+    }
+    temp->direct = 0;
+    temp->readonly = 0;
+    temp->align = 1;
+    temp->path = malloc(strlen(io->path) + 8);
+    if (temp->path == NULL)
+    {
+        return 0;
+    }
+    sprintf(temp->path, "%s.XXXXXX", io->path);
+    temp->fd = mkstemp(temp->path);
+    if (temp->fd == -1)
+    {
+        free(temp->path);
+        temp->path = NULL;
+        return 0;
+    }
+    // Changing the owner drops set-user-ID bits, so it comes first:
+    if (((st.st_uid != geteuid() || st.st_gid != getegid())
+         && fchown(temp->fd, st.st_uid, st.st_gid) != 0)
+        || fchmod(temp->fd, st.st_mode & 07777) != 0)
+    {
+        io_discard(temp);
+        return 0;
+    }
+    return 1;
+#else
+    (void)io;
+    (void)temp;
+    return 0;
+#endif
+}
+
+// Puts temp in place of the file once it is on disk, and continues with it
+// in io. On failure the file is as it was.
+int io_replace(struct io* io, struct io* temp)
+{
+#if defined(HAVE_PREAD)
+    char* slash = strrchr(io->path, '/');
+    int directory;
+
+    if (fsync(temp->fd) != 0 || rename(temp->path, io->path) != 0)
+    {
+        return 0;
+    }
+    // The new name only lasts once the directory has made it to the disk:
+    if (slash != NULL)
+    {
+        *slash = '\0';
+        directory = open(slash == io->path ? "/" : io->path, O_RDONLY);
+        *slash = '/';
+        if (directory != -1)
+        {
+            fsync(directory);
+            close(directory);
+        }
+    }
+    close(io->fd);
+    io->fd = temp->fd;
+    free(temp->path);
+    temp->fd = -1;
+    temp->path = NULL;
+    return 1;
+#else
+    (void)io;
+    (void)temp;
+    return 0;
+#endif
+}
+
+#if defined(HAVE_IO_URING) || defined(HAVE_PTHREAD)
+#define HAVE_ASYNC 1
+
+// Background reads: io_uring where the kernel has it, a worker thread
+// otherwise. Requests complete in any order, known by the caller's tag.
+#define ASYNC_DEPTH 32
+
+enum async_engine
+{
+    ASYNC_NONE,
+    ASYNC_URING,
+    ASYNC_THREAD
+};
+
+enum async_state
+{
+    ASYNC_FREE,
+    ASYNC_QUEUED,
+    ASYNC_RUNNING,
+    ASYNC_DONE
+};
+
+struct async_request
+{
+    enum async_state state;
+    offset_t offset;
+    unsigned char* data;
+    size_t size;
+    void* tag;
+    int ok;
+#if defined(HAVE_IO_URING)
+    struct iovec iov;
+#endif
+};
+
+struct async
+{
+    enum async_engine engine;
+    struct io* io;
+    size_t pending;
+    struct async_request requests[ASYNC_DEPTH];
+#if defined(HAVE_IO_URING)
+    int ring;
+    unsigned char* sq_ring;
+    size_t sq_ring_size;
+    unsigned char* cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+#endif
+#if defined(HAVE_PTHREAD)
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t done;
+    int stop;
+#endif
+};
+
+#if defined(HAVE_IO_URING)
+static void async_uring_close(struct async* a)
+{
+    if (a->sqes != NULL)
+    {
+        munmap(a->sqes, a->sqes_size);
+    }
+    if (a->cq_ring != NULL && a->cq_ring != a->sq_ring)
+    {
+        munmap(a->cq_ring, a->cq_ring_size);
+    }
+    if (a->sq_ring != NULL)
+    {
+        munmap(a->sq_ring, a->sq_ring_size);
+    }
+    if (a->ring != -1)
+    {
+        close(a->ring);
+    }
+    a->ring = -1;
+    a->sq_ring = NULL;
+    a->cq_ring = NULL;
+    a->sqes = NULL;
+}
+
+static int async_uring_open(struct async* a)
+{
+    struct io_uring_params params;
+    void* map;
+
+    a->sq_ring = NULL;
+    a->cq_ring = NULL;
+    a->sqes = NULL;
+    memset(&params, 0, sizeof(params));
+    a->ring = syscall(__NR_io_uring_setup, ASYNC_DEPTH, &params);
+    if (a->ring < 0)
+    {
+        a->ring = -1;
+        return 0;
+    }
+    a->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    a->cq_ring_size = params.cq_off.cqes
+        + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        a->sq_ring_size = a->cq_ring_size =
+            max(a->sq_ring_size, a->cq_ring_size);
+    }
+    map = mmap(NULL, a->sq_ring_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, a->ring, IORING_OFF_SQ_RING);
+    if (map == MAP_FAILED)
+    {
+        goto error;
+    }
+    a->sq_ring = map;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        a->cq_ring = a->sq_ring;
+    }
+    else
+    {
+        map = mmap(NULL, a->cq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, a->ring, IORING_OFF_CQ_RING);
+        if (map == MAP_FAILED)
+        {
+            goto error;
+        }
+        a->cq_ring = map;
+    }
+    a->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    map = mmap(NULL, a->sqes_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, a->ring, IORING_OFF_SQES);
+    if (map == MAP_FAILED)
+    {
+        goto error;
+    }
+    a->sqes = map;
+    a->sq_tail = (unsigned*)(a->sq_ring + params.sq_off.tail);
+    a->sq_mask = (unsigned*)(a->sq_ring + params.sq_off.ring_mask);
+    a->sq_array = (unsigned*)(a->sq_ring + params.sq_off.array);
+    a->cq_head = (unsigned*)(a->cq_ring + params.cq_off.head);
+    a->cq_tail = (unsigned*)(a->cq_ring + params.cq_off.tail);
+    a->cq_mask = (unsigned*)(a->cq_ring + params.cq_off.ring_mask);
+    a->cqes = (struct io_uring_cqe*)(a->cq_ring + params.cq_off.cqes);
+    return 1;
+error:
+    async_uring_close(a);
+    return 0;
+}
+
+static int async_uring_submit(struct async* a, size_t slot)
+{
+    struct async_request* r = &a->requests[slot];
+    unsigned tail = *a->sq_tail;
+    unsigned index = tail & *a->sq_mask;
+    struct io_uring_sqe* sqe = &a->sqes[index];
+
+    r->iov.iov_base = r->data;
+    r->iov.iov_len = r->size;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = a->io->fd;
+    sqe->off = r->offset;
+    sqe->addr = (unsigned long)&r->iov;
+    sqe->len = 1;
+    sqe->user_data = slot;
+    a->sq_array[index] = index;
+    __atomic_store_n(a->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return syscall(__NR_io_uring_enter, a->ring, 1, 0, 0, NULL, 0) == 1;
+}
+
+// Moves whatever the kernel has completed into the request slots.
+static void async_uring_complete(struct async* a)
+{
+    unsigned head = *a->cq_head;
+    unsigned tail = __atomic_load_n(a->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe* cqe = &a->cqes[head & *a->cq_mask];
+        struct async_request* r = &a->requests[cqe->user_data];
+
+        r->ok = cqe->res >= 0;
+        if (r->ok && (size_t)cqe->res < r->size)
+        {
+            // Short read, finish it the plain way:
+            r->ok = io_read(a->io, r->offset + cqe->res,
+                            r->data + cqe->res, r->size - cqe->res);
+        }
+        r->state = ASYNC_DONE;
+    }
+    __atomic_store_n(a->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+#if defined(HAVE_PTHREAD)
+static void* async_worker(void* arg)
+{
+    struct async* a = arg;
+
+    pthread_mutex_lock(&a->lock);
+    for (;;)
+    {
+        struct async_request* r = NULL;
+        size_t i;
+        int ok;
+
+        for (i = 0; i < ASYNC_DEPTH && r == NULL; i++)
+        {
+            if (a->requests[i].state == ASYNC_QUEUED)
+            {
+                r = &a->requests[i];
+            }
+        }
+        if (r == NULL)
+        {
+            if (a->stop)
+            {
+                break;
+            }
+            pthread_cond_wait(&a->queued, &a->lock);
+            continue;
+        }
+        r->state = ASYNC_RUNNING;
+        pthread_mutex_unlock(&a->lock);
+        ok = io_read(a->io, r->offset, r->data, r->size);
+        pthread_mutex_lock(&a->lock);
+        r->ok = ok;
+        r->state = ASYNC_DONE;
+        pthread_cond_signal(&a->done);
+    }
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+}
+#endif
+
+static int async_start(struct async* a, struct io* io)
+{
+    size_t i;
+
+    a->engine = ASYNC_NONE;
+    a->io = io;
+    a->pending = 0;
+    for (i = 0; i < ASYNC_DEPTH; i++)
+    {
+        a->requests[i].state = ASYNC_FREE;
+    }
+#if defined(HAVE_IO_URING)
+    if (async_uring_open(a))
+    {
+        a->engine = ASYNC_URING;
+        return 1;
+    }
+#endif
+#if defined(HAVE_PTHREAD)
+    a->stop = 0;
+    if (pthread_mutex_init(&a->lock, NULL) == 0)
+    {
+        if (pthread_cond_init(&a->queued, NULL) == 0)
+        {
+            if (pthread_cond_init(&a->done, NULL) == 0)
+            {
+                if (pthread_create(&a->thread, NULL, async_worker, a) == 0)
+                {
+                    a->engine = ASYNC_THREAD;
+                    return 1;
+                }
+                pthread_cond_destroy(&a->done);
+            }
+            pthread_cond_destroy(&a->queued);
+        }
+        pthread_mutex_destroy(&a->lock);
+    }
+#endif
+    return 0;
+}
+
+// Queues a read of size bytes at offset into data. Fails when all slots are
+// taken, so that the caller can fall back to reading synchronously.
+static int async_submit(struct async* a, offset_t offset, unsigned char* data,
+        size_t size, void* tag)
+{
+    size_t slot;
+
+    if (a->engine == ASYNC_NONE)
+    {
+        return 0;
+    }
+#if defined(HAVE_PTHREAD)
+    if (a->engine == ASYNC_THREAD)
+    {
+        pthread_mutex_lock(&a->lock);
+    }
+#endif
+    for (slot = 0; slot < ASYNC_DEPTH; slot++)
+    {
+        if (a->requests[slot].state == ASYNC_FREE)
+        {
+            struct async_request* r = &a->requests[slot];
+            r->state = ASYNC_QUEUED;
+            r->offset = offset;
+            r->data = data;
+            r->size = size;
+            r->tag = tag;
+            r->ok = 0;
+            break;
+        }
+    }
+#if defined(HAVE_PTHREAD)
+    if (a->engine == ASYNC_THREAD)
+    {
+        if (slot < ASYNC_DEPTH)
+        {
+            pthread_cond_signal(&a->queued);
+        }
+        pthread_mutex_unlock(&a->lock);
+    }
+#endif
+    if (slot == ASYNC_DEPTH)
+    {
+        return 0;
+    }
+#if defined(HAVE_IO_URING)
+    if (a->engine == ASYNC_URING && !async_uring_submit(a, slot))
+    {
+        a->requests[slot].state = ASYNC_FREE;
+        return 0;
+    }
+#endif
+    ++a->pending;
+    return 1;
+}
+
+// Hands out one completed request, if there is any, without blocking.
+static int async_reap(struct async* a, void** tag, int* ok)
+{
+    size_t slot;
+
+    if (a->pending == 0)
+    {
+        return 0;
+    }
+#if defined(HAVE_IO_URING)
+    if (a->engine == ASYNC_URING)
+    {
+        async_uring_complete(a);
+    }
+#endif
+#if defined(HAVE_PTHREAD)
+    if (a->engine == ASYNC_THREAD)
+    {
+        pthread_mutex_lock(&a->lock);
+    }
+#endif
+    for (slot = 0; slot < ASYNC_DEPTH; slot++)
+    {
+        struct async_request* r = &a->requests[slot];
+        if (r->state == ASYNC_DONE)
+        {
+            *tag = r->tag;
+            *ok = r->ok;
+            r->state = ASYNC_FREE;
+            --a->pending;
+            break;
+        }
+    }
+#if defined(HAVE_PTHREAD)
+    if (a->engine == ASYNC_THREAD)
+    {
+        pthread_mutex_unlock(&a->lock);
+    }
+#endif
+    return slot < ASYNC_DEPTH;
+}
+
+// Blocks until at least one request has completed.
+static void async_wait(struct async* a)
+{
+    size_t slot;
+
+    if (a->pending == 0)
+    {
+        return;
+    }
+#if defined(HAVE_IO_URING)
+    if (a->engine == ASYNC_URING)
+    {
+        async_uring_complete(a);
+        for (slot = 0; slot < ASYNC_DEPTH; slot++)
+        {
+            if (a->requests[slot].state == ASYNC_DONE)
+            {
+                return;
+            }
+        }
+        syscall(__NR_io_uring_enter, a->ring, 0, 1, IORING_ENTER_GETEVENTS,
+                NULL, 0);
+        async_uring_complete(a);
+        return;
+    }
+#endif
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_lock(&a->lock);
+    for (;;)
+    {
+        for (slot = 0; slot < ASYNC_DEPTH; slot++)
+        {
+            if (a->requests[slot].state == ASYNC_DONE)
+            {
+                break;
+            }
+        }
+        if (slot < ASYNC_DEPTH)
+        {
+            break;
+        }
+        pthread_cond_wait(&a->done, &a->lock);
+    }
+    pthread_mutex_unlock(&a->lock);
+#endif
+}
+
+// Waits for everything in flight and shuts the engine down.
+static void async_stop(struct async* a)
+{
+    void* tag;
+    int ok;
+
+    while (a->pending > 0)
+    {
+        async_wait(a);
+        while (async_reap(a, &tag, &ok))
+        {
+        }
+    }
+#if defined(HAVE_IO_URING)
+    if (a->engine == ASYNC_URING)
+    {
+        async_uring_close(a);
+    }
+#endif
+#if defined(HAVE_PTHREAD)
+    if (a->engine == ASYNC_THREAD)
+    {
+        pthread_mutex_lock(&a->lock);
+        a->stop = 1;
+        pthread_cond_signal(&a->queued);
+        pthread_mutex_unlock(&a->lock);
+        pthread_join(a->thread, NULL);
+        pthread_cond_destroy(&a->done);
+        pthread_cond_destroy(&a->queued);
+        pthread_mutex_destroy(&a->lock);
+    }
+#endif
+    a->engine = ASYNC_NONE;
+}
+#endif
+
+enum edit_mode { HEX, ASCII };
+
+enum buffer_backend
+{
+    BUFFER_READ,
+    BUFFER_MMAP
+};
+
+#if defined(HAVE_MMAP)
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+// Maps the whole file where the address space allows it, otherwise a
+// window aligned to half its size, so that any access of up to half fits.
+#define BUFFER_MAP_WINDOW (sizeof(void*) < 8 ? 64UL*1024*1024 : 0)
+#endif
+
+// The read backend's page cache. Scans get a lane of their own, so that
+// they do not evict the pages behind the screen.
+#define BUFFER_PAGE_SIZE 4096
+// On DOS all of it must fit in a 64 KiB block.
+#if defined(__DOS__)
+#define BUFFER_PAGE_COUNT 8
+#else
+#define BUFFER_PAGE_COUNT 256
+#endif
+#if defined(__DOS__)
+#define BUFFER_STREAM_PAGE_COUNT 2
+#else
+#define BUFFER_STREAM_PAGE_COUNT 4
+#endif
+
+// When the pages behind the screen are not resident in a mapping, the view
+// polls for them this many times before it gives up and faults them in.
+#define BUFFER_MAP_WAITS 10
+
+// Read-ahead doubles from the smaller size up to the larger one while the
+// view keeps moving one way.
+#define BUFFER_READAHEAD_MIN (64UL*1024)
+#define BUFFER_READAHEAD_MAX (4UL*1024*1024)
+
+// Moving data goes through two buffers of this size, one read while the
+// other is written.
+#if defined(__DOS__)
+#define BUFFER_MOVE_SIZE (32UL*1024)
+#else
+#define BUFFER_MOVE_SIZE (4UL*1024*1024)
+#endif
+
+enum page_state
+{
+    PAGE_EMPTY,
+    PAGE_LOADING,
+    PAGE_VALID
+};
+
+struct page
+{
+    offset_t offset;
+    size_t length;
+    enum page_state state;
+    int stale;              // Invalidated while loading, drop on arrival.
+    int referenced;
+    size_t dirty_start;     // Written to but not yet to the file, if the
+    size_t dirty_end;       // range is not empty.
+    unsigned char* data;
+};
+
+// The contents are a table of pieces from the file, the add buffer or
+// zeros. Edits only change the table until it is saved.
+enum piece_kind
+{
+    PIECE_FILE,
+    PIECE_ADD,
+    PIECE_ZERO
+};
+
+struct piece
+{
+    offset_t offset;        // Where the piece starts in the contents.
+    offset_t length;
+    offset_t source;        // Where its bytes start in the file or add buffer.
+    enum piece_kind kind;
+};
+
+// An entry of the history: the pieces to put back at offset in place of
+// length bytes. Reverting a change turns it into its redo.
+struct change
+{
+    offset_t offset;
+    offset_t length;
+    struct piece* pieces;
+    size_t piece_count;
+};
+
+// Initial sizes, which double as needed. The oldest changes are dropped
+// past BUFFER_HISTORY_PIECES.
+#define BUFFER_PIECE_COUNT 64
+#define BUFFER_ADD_SIZE 4096
+#define BUFFER_CHANGE_COUNT 64
+#define BUFFER_CHANGE_PIECES 8
+#define BUFFER_HISTORY_PIECES 65536UL
+
+// A fill adds the pattern to the add buffer repeated up to this many bytes
+// once, and refers to that tile as often as it takes.
+#if defined(__DOS__)
+#define BUFFER_FILL_SIZE (32UL*1024)
+#else
+#define BUFFER_FILL_SIZE (1024UL*1024)
+#endif
+
+struct buffer
+{
+    struct io* io;
+    enum buffer_backend backend;
+    offset_t filesize;
+    offset_t length;        // Size of the contents with the edits.
+    struct piece* pieces;   // Sorted by offset, covering 0 to length.
+    size_t piece_count;
+    size_t piece_capacity;
+    unsigned char* add;
+    size_t add_length;
+    size_t add_capacity;
+    int modified;
+    struct change* changes; // undo_count to undo, then the ones to redo.
+    size_t change_count;
+    size_t change_capacity;
+    size_t undo_count;
+    size_t history_pieces;
+    int history_lost;       // Changes since the last save were forgotten.
+    int typing;             // The last change takes in further typing.
+    struct change clipboard; // The pieces copied last, length their size.
+    // Called as long operations make progress, with the bytes done and the
+    // total; returning 0 cancels the operation. May be NULL.
+    int (*progress)(struct buffer* b, offset_t done, offset_t total);
+    offset_t progress_done;
+    offset_t progress_total;
+    int in_place;           // Saves rewrite the file rather than replace it.
+    int threads;            // How many threads buffer_search() may use.
+    int damaged;            // The last save failed halfway through the file.
+    struct io journal;      // See buffer_journal_open().
+    char* journal_name;     // NULL when not journaling.
+    offset_t journal_end;
+    unsigned char* journal_data; // Appends not written yet; NULL until the
+    size_t journal_length;       // journal from before has been recovered.
+    int journal_unsynced;
+    unsigned char* span;    // Spans crossing pieces are assembled here.
+    unsigned char* zeros;   // What pieces of zeros read as.
+    size_t size;            // Largest span buffer_access() hands out.
+    unsigned char* buffer;  // Spans crossing pages are assembled here.
+    struct page* pages;     // page_count pages, then the stream lane.
+    unsigned char* page_data;
+    size_t page_count;
+    size_t page_size;
+    size_t clock;
+    size_t stream_count;
+    size_t stream_next;
+    int scanning;
+    size_t dirty_count;     // Pages with writes still to go to the file.
+    int flush_failed;       // Since the last buffer_file_flush().
+    offset_t readahead_last;
+    offset_t readahead_until;
+    size_t readahead_size;
+    int readahead_direction;
+    offset_t extent_offset; // Last extent looked up, see buffer_file_hole().
+    offset_t extent_end;
+    int extent_hole;
+    int extent_valid;
+    struct page* last;
+    unsigned long hits;
+    unsigned long misses;
+#if defined(HAVE_MMAP)
+    unsigned char* map;
+    offset_t map_offset;
+    size_t map_size;
+    int map_waiting;
+    int map_waits;
+#endif
+#if defined(HAVE_ASYNC)
+    struct async async;
+#endif
+};
+
+#if defined(HAVE_MMAP)
+// Mapped pages past the end of a file truncated behind our back raise
+// SIGBUS: the handler maps zeros there and flags the mapping for a remap.
+static volatile sig_atomic_t buffer_truncated = 0;
+static unsigned char* volatile sigbus_map = NULL;
+static volatile size_t sigbus_map_size = 0;
+static size_t sigbus_page_size = 0;
+
+static void buffer_sigbus(int sig, siginfo_t* info, void* context)
+{
+    unsigned char* address = info->si_addr;
+
+    (void)context;
+    if (sigbus_map != NULL
+        && address >= sigbus_map
+        && address < sigbus_map + sigbus_map_size)
+    {
+        address -= (size_t)(address - sigbus_map) % sigbus_page_size;
+        if (mmap(address, sigbus_page_size, PROT_READ | PROT_WRITE,
+                 MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) != MAP_FAILED)
+        {
+            buffer_truncated = 1;
+            return;
+        }
+    }
+    // Not ours, or we could not patch it: fault again and die as usual.
+    signal(sig, SIG_DFL);
+}
+
+static void buffer_unmap(struct buffer* b)
+{
+    if (b->map != NULL)
+    {
+        sigbus_map = NULL;
+        munmap(b->map, b->map_size);
+    }
+    b->map = NULL;
+    b->map_offset = 0;
+    b->map_size = 0;
+}
+
+static int buffer_map(struct buffer* b, offset_t offset, size_t size)
+{
+    size_t window = BUFFER_MAP_WINDOW;
+    offset_t map_offset = 0;
+    offset_t map_size;
+    void* map;
+
+    if (b->map != NULL
+        && offset >= b->map_offset
+        && offset + size <= b->map_offset + b->map_size)
+    {
+        return 1;
+    }
+    buffer_unmap(b);
+    if (window != 0)
+    {
+        map_offset = offset - offset % (window / 2);
+    }
+    if (offset + size > b->filesize || map_offset >= b->filesize)
+    {
+        return 0;
+    }
+    map_size = b->filesize - map_offset;
+    if (window != 0 && map_size > window)
+    {
+        map_size = window;
+    }
+    // Read-only mappings of the same file share their pages between all
+    // processes that have it open.
+    map = mmap(NULL, map_size,
+               b->io->readonly ? PROT_READ : PROT_READ | PROT_WRITE,
+               MAP_SHARED,
+               b->io->fd, map_offset);
+    if (map == MAP_FAILED)
+    {
+        return 0;
+    }
+    b->map = map;
+    b->map_offset = map_offset;
+    b->map_size = map_size;
+    if (b->scanning)
+    {
+        posix_madvise(b->map, b->map_size, POSIX_MADV_SEQUENTIAL);
+    }
+    sigbus_map_size = b->map_size;
+    sigbus_map = b->map;
+    return offset + size <= b->map_offset + b->map_size;
+}
+
+static void buffer_remap(struct buffer* b)
+{
+    buffer_truncated = 0;
+    buffer_unmap(b);
+    io_size(b->io, &b->filesize);
+}
+#endif
+
+// Finds the piece that contains offset by bisection. Offsets past the end
+// give piece_count.
+static size_t buffer_piece(struct buffer* b, offset_t offset)
+{
+    size_t low = 0;
+    size_t high = b->piece_count;
+
+    if (offset >= b->length)
+    {
+        return b->piece_count;
+    }
+    while (high - low > 1)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (b->pieces[middle].offset <= offset)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static void buffer_clear_history(struct buffer* b)
+{
+    while (b->change_count > 0)
+    {
+        free(b->changes[--b->change_count].pieces);
+    }
+    b->undo_count = 0;
+    b->history_pieces = 0;
+    b->history_lost = 0;
+    b->typing = 0;
+}
+
+// Describes the file as it is, without any edits or history.
+static void buffer_unedited(struct buffer* b)
+{
+    buffer_clear_history(b);
+    b->piece_count = 0;
+    if (b->filesize > 0)
+    {
+        b->pieces[0].offset = 0;
+        b->pieces[0].length = b->filesize;
+        b->pieces[0].source = 0;
+        b->pieces[0].kind = PIECE_FILE;
+        b->piece_count = 1;
+    }
+    b->length = b->filesize;
+    b->add_length = 0;
+    b->modified = 0;
+}
+
+// Writes what was written to the page back to the file. A failure is
+// reported by the next buffer_file_flush(), the page is clean either way.
+static void buffer_page_flush(struct buffer* b, struct page* p)
+{
+    size_t start = p->dirty_start;
+    size_t end = p->dirty_end;
+
+    if (start == end)
+    {
+        return;
+    }
+#if defined(HAVE_PREAD)
+    // Bypassing the system's cache takes whole blocks:
+    if (b->io->direct)
+    {
+        start = 0;
+        end = p->length;
+    }
+#endif
+    if (!io_write(b->io, p->offset + start, &p->data[start], end - start))
+    {
+        b->flush_failed = 1;
+    }
+    p->dirty_start = 0;
+    p->dirty_end = 0;
+    --b->dirty_count;
+}
+
+// Writes the dirty pages back in offset order. Anything that changes the
+// file other than buffer_file_write() flushes first.
+static int buffer_file_flush(struct buffer* b)
+{
+    int result;
+
+    while (b->dirty_count > 0)
+    {
+        struct page* first = NULL;
+        size_t i;
+
+        for (i = 0; i < b->page_count + b->stream_count; i++)
+        {
+            struct page* p = &b->pages[i];
+            if (p->dirty_start != p->dirty_end
+                && (first == NULL || p->offset < first->offset))
+            {
+                first = p;
+            }
+        }
+        buffer_page_flush(b, first);
+    }
+    result = !b->flush_failed;
+    b->flush_failed = 0;
+    return result;
+}
+
+void buffer_invalidate(struct buffer* b)
+{
+    size_t i;
+
+    buffer_file_flush(b);
+    for (i = 0; i < b->page_count + b->stream_count; i++)
+    {
+        if (b->pages[i].state == PAGE_LOADING)
+        {
+            b->pages[i].stale = 1;
+        }
+        else
+        {
+            b->pages[i].state = PAGE_EMPTY;
+        }
+    }
+    b->last = NULL;
+}
+
+// Drops the cached pages overlapping the given range.
+static void buffer_invalidate_range(struct buffer* b, offset_t offset,
+        offset_t size)
+{
+    size_t i;
+
+    for (i = 0; i < b->page_count + b->stream_count; i++)
+    {
+        struct page* p = &b->pages[i];
+        if (p->state != PAGE_EMPTY
+            && offset < p->offset + b->page_size
+            && offset + size > p->offset)
+        {
+            if (p->state == PAGE_LOADING)
+            {
+                p->stale = 1;
+            }
+            else
+            {
+                p->state = PAGE_EMPTY;
+            }
+        }
+    }
+    b->last = NULL;
+}
+
+// Picks the page to fill: round robin in the stream lane for scans, CLOCK
+// otherwise.
+static struct page* buffer_evict(struct buffer* b)
+{
+    if (b->scanning && b->stream_count > 0)
+    {
+        struct page* p = &b->pages[b->page_count + b->stream_next];
+        b->stream_next = (b->stream_next + 1) % b->stream_count;
+        buffer_page_flush(b, p);
+        p->state = PAGE_EMPTY;
+        return p;
+    }
+    // Pages being loaded are skipped. There are never more of them in
+    // flight than a fraction of the cache, so the sweep terminates.
+    for (;;)
+    {
+        struct page* p = &b->pages[b->clock];
+        b->clock = (b->clock + 1) % b->page_count;
+        if (p->state == PAGE_EMPTY)
+        {
+            return p;
+        }
+        if (p->state == PAGE_LOADING)
+        {
+            continue;
+        }
+        if (!p->referenced)
+        {
+            buffer_page_flush(b, p);
+            p->state = PAGE_EMPTY;
+            return p;
+        }
+        p->referenced = 0;
+    }
+}
+
+// Finds the page starting at the given page aligned offset, in whatever
+// state it is.
+static struct page* buffer_lookup(struct buffer* b, offset_t offset)
+{
+    size_t i;
+
+    if (b->last != NULL
+        && b->last->state == PAGE_VALID
+        && b->last->offset == offset)
+    {
+        return b->last;
+    }
+    for (i = 0; i < b->page_count + b->stream_count; i++)
+    {
+        if (b->pages[i].state != PAGE_EMPTY && b->pages[i].offset == offset)
+        {
+            return &b->pages[i];
+        }
+    }
+    return NULL;
+}
+
+// Lands the background fills that have completed. Returns the number of
+// pages that became valid.
+static int buffer_poll(struct buffer* b)
+{
+    int landed = 0;
+#if defined(HAVE_ASYNC)
+    void* tag;
+    int ok;
+
+    while (async_reap(&b->async, &tag, &ok))
+    {
+        struct page* p = tag;
+        p->state = ok && !p->stale ? PAGE_VALID : PAGE_EMPTY;
+        p->stale = 0;
+        landed += p->state == PAGE_VALID;
+    }
+#endif
+#if defined(HAVE_MMAP)
+    if (buffer_truncated)
+    {
+        buffer_remap(b);
+    }
+    // Without edits the view follows the file:
+    if (!b->modified && b->length != b->filesize)
+    {
+        // The add buffer still holds what is on the clipboard:
+        size_t add_length = b->add_length;
+
+        buffer_unedited(b);
+        b->add_length = add_length;
+    }
+    b->map_waits = b->map_waiting ? b->map_waits + 1 : 0;
+    b->map_waiting = 0;
+#endif
+    (void)b;
+    return landed;
+}
+
+// Tells whether the view is waiting for data to arrive in the background.
+static int buffer_pending(struct buffer* b)
+{
+#if defined(HAVE_ASYNC)
+    if (b->async.pending > 0)
+    {
+        return 1;
+    }
+#endif
+#if defined(HAVE_MMAP)
+    if (b->map_waiting)
+    {
+        return 1;
+    }
+#endif
+    (void)b;
+    return 0;
+}
+
+// Returns the cached page starting at the given page aligned offset,
+// reading it from the file on a miss.
+static struct page* buffer_page(struct buffer* b, offset_t offset)
+{
+    struct page* p = buffer_lookup(b, offset);
+
+#if defined(HAVE_ASYNC)
+    // Already on its way: wait for it rather than reading it twice.
+    while (p != NULL && p->state == PAGE_LOADING)
+    {
+        async_wait(&b->async);
+        buffer_poll(b);
+        p = buffer_lookup(b, offset);
+    }
+#endif
+    if (p != NULL)
+    {
+        ++b->hits;
+    }
+    else
+    {
+        ++b->misses;
+        p = buffer_evict(b);
+        p->offset = offset;
+        p->length = min(b->page_size, b->filesize - offset);
+        if (!io_read(b->io, p->offset, p->data, p->length))
+        {
+            return NULL;
+        }
+        p->state = PAGE_VALID;
+    }
+    // A scan touching a page once says nothing about it being reused.
+    if (!b->scanning)
+    {
+        p->referenced = 1;
+    }
+    b->last = p;
+    return p;
+}
+
+// Brackets a sequential pass over (a large part of) the file. Pages missed in
+// between go through the stream lane instead of the main cache.
+static void buffer_scan_begin(struct buffer* b)
+{
+#if defined(HAVE_MMAP)
+    if (b->scanning == 0 && b->map != NULL)
+    {
+        posix_madvise(b->map, b->map_size, POSIX_MADV_SEQUENTIAL);
+    }
+#endif
+    ++b->scanning;
+}
+
+static void buffer_scan_end(struct buffer* b)
+{
+    --b->scanning;
+#if defined(HAVE_MMAP)
+    if (b->scanning == 0 && b->map != NULL)
+    {
+        posix_madvise(b->map, b->map_size, POSIX_MADV_NORMAL);
+    }
+#endif
+}
+
+// Asks the kernel to start reading the given range in the background, so
+// that it is in memory by the time we access it.
+static void buffer_prefetch(struct buffer* b, offset_t offset, offset_t size)
+{
+#if defined(HAVE_MMAP)
+    if (b->backend == BUFFER_MMAP)
+    {
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        offset_t end = offset + size;
+
+        if (b->map == NULL)
+        {
+            return;
+        }
+        offset = max(offset, b->map_offset);
+        end = min(end, b->map_offset + b->map_size);
+        if (offset < end)
+        {
+            offset -= (offset - b->map_offset) % page_size;
+            posix_madvise(&b->map[offset - b->map_offset], end - offset,
+                          POSIX_MADV_WILLNEED);
+        }
+        return;
+    }
+#endif
+#if defined(HAVE_PREAD) && defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(b->io->fd, offset, size, POSIX_FADV_WILLNEED);
+#else
+    (void)b;
+    (void)offset;
+    (void)size;
+#endif
+}
+
+// Prefetches ahead of the view while it moves one way, more each time it
+// catches up. Jumps reset it.
+static void buffer_readahead(struct buffer* b, offset_t offset, size_t size)
+{
+    size_t i = buffer_piece(b, offset);
+    offset_t distance;
+    int direction;
+
+    // The view is in terms of the contents, read-ahead in terms of the file:
+    if (i == b->piece_count || b->pieces[i].kind != PIECE_FILE)
+    {
+        return;
+    }
+    offset = b->pieces[i].source + (offset - b->pieces[i].offset);
+    if (offset == b->readahead_last)
+    {
+        return;
+    }
+    direction = offset > b->readahead_last ? 1 : -1;
+    distance = direction > 0
+        ? offset - b->readahead_last
+        : b->readahead_last - offset;
+    b->readahead_last = offset;
+    if (distance > max(b->readahead_size, BUFFER_READAHEAD_MIN))
+    {
+        b->readahead_direction = 0;
+        b->readahead_size = 0;
+        return;
+    }
+    if (direction != b->readahead_direction)
+    {
+        b->readahead_direction = direction;
+        b->readahead_size = 0;
+        b->readahead_until = offset;
+    }
+    if (direction > 0)
+    {
+        offset_t end = min(offset + size, b->filesize);
+        offset_t from = max(end, b->readahead_until);
+
+        if (from - end > b->readahead_size / 2 || from >= b->filesize)
+        {
+            return;
+        }
+        b->readahead_size = b->readahead_size == 0
+            ? BUFFER_READAHEAD_MIN
+            : min(2 * b->readahead_size, BUFFER_READAHEAD_MAX);
+        b->readahead_until = min(from + b->readahead_size, b->filesize);
+        buffer_prefetch(b, from, b->readahead_until - from);
+    }
+    else
+    {
+        offset_t to = min(offset, b->readahead_until);
+
+        if (offset - to > b->readahead_size / 2 || to == 0)
+        {
+            return;
+        }
+        b->readahead_size = b->readahead_size == 0
+            ? BUFFER_READAHEAD_MIN
+            : min(2 * b->readahead_size, BUFFER_READAHEAD_MAX);
+        b->readahead_until = to > b->readahead_size
+            ? to - b->readahead_size
+            : 0;
+        buffer_prefetch(b, b->readahead_until, to - b->readahead_until);
+    }
+}
+
+// Unsaved edits are journaled next to the file, and replayed after a
+// crash. After the header (buffer_journal_header()), each record is an
+// operation byte, a 64 bit little-endian offset and size, and the data of
+// writes. Clipboard copies are journaled too, so that pastes replay.
+#define BUFFER_JOURNAL_SUFFIX ".he-journal"
+#define BUFFER_JOURNAL_MAGIC "HEJOURN2"
+#define BUFFER_JOURNAL_HEADER 40
+#define BUFFER_JOURNAL_RECORD 17
+#if defined(__DOS__)
+#define BUFFER_JOURNAL_SIZE (16UL*1024)
+#else
+#define BUFFER_JOURNAL_SIZE (64UL*1024)
+#endif
+
+enum journal_op
+{
+    JOURNAL_WRITE = 'w',
+    JOURNAL_INSERT = 'i',
+    JOURNAL_INSERT_DATA = 'n',
+    JOURNAL_REMOVE = 'r',
+    JOURNAL_UNDO = 'u',
+    JOURNAL_REDO = 'd',
+    JOURNAL_SEAL = 's',
+    JOURNAL_FILL = 'f',     // Data is the size to fill, then the pattern.
+    JOURNAL_COPY = 'c',
+    JOURNAL_PASTE = 'p',
+    JOURNAL_CLIP = 'k',     // Bytes for the clipboard, or
+    JOURNAL_CLIP_ZERO = 'z' // zeros, to go after what it holds.
+};
+
+static int journal_has_data(int op)
+{
+    return op == JOURNAL_WRITE
+        || op == JOURNAL_INSERT_DATA
+        || op == JOURNAL_FILL
+        || op == JOURNAL_CLIP;
+}
+
+static void journal_put(unsigned char* p, offset_t value)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+        p[i] = (unsigned char)(i < (int)sizeof(value) ? value >> (8 * i) : 0);
+    }
+}
+
+static offset_t journal_get(const unsigned char* p)
+{
+    offset_t value = 0;
+    int i;
+
+    for (i = (int)sizeof(value); i-- > 0;)
+    {
+        value = value << 8 | p[i];
+    }
+    return value;
+}
+
+// Stops journaling, and removes the journal.
+static void buffer_journal_close(struct buffer* b)
+{
+    if (b->journal_name == NULL)
+    {
+        return;
+    }
+#if defined(HAVE_PREAD)
+    // Removed while still locked, so that no other instance takes it up in
+    // between:
+    remove(b->journal_name);
+    io_close(&b->journal);
+#else
+    io_close(&b->journal);
+    remove(b->journal_name);
+#endif
+    free(b->journal_name);
+    free(b->journal_data);
+    b->journal_name = NULL;
+    b->journal_data = NULL;
+    b->journal_length = 0;
+    b->journal_unsynced = 0;
+}
+
+// Writes out the appends collected in memory.
+static int buffer_journal_flush(struct buffer* b)
+{
+    if (b->journal_length > 0)
+    {
+        if (!io_write(&b->journal, b->journal_end, b->journal_data,
+                      b->journal_length))
+        {
+            return 0;
+        }
+        b->journal_end += b->journal_length;
+        b->journal_length = 0;
+    }
+    return 1;
+}
+
+// Appends an edit to the journal. A journal that cannot be written is
+// given up rather than left half written.
+static void buffer_journal_record(struct buffer* b, enum journal_op op,
+        offset_t offset, offset_t size, const unsigned char* data)
+{
+    size_t data_size = journal_has_data(op) ? (size_t)size : 0;
+    unsigned char* record;
+
+    if (b->journal_data == NULL)
+    {
+        return;
+    }
+    if ((unsigned long)b->journal_length + BUFFER_JOURNAL_RECORD + data_size
+            > BUFFER_JOURNAL_SIZE
+        && !buffer_journal_flush(b))
+    {
+        goto error;
+    }
+    record = &b->journal_data[b->journal_length];
+    record[0] = (unsigned char)op;
+    journal_put(&record[1], offset);
+    journal_put(&record[9], size);
+    b->journal_length += BUFFER_JOURNAL_RECORD;
+    if (data_size > BUFFER_JOURNAL_SIZE - BUFFER_JOURNAL_RECORD)
+    {
+        // Too large to collect, it goes straight out:
+        if (!buffer_journal_flush(b)
+            || !io_write(&b->journal, b->journal_end, data, data_size))
+        {
+            goto error;
+        }
+        b->journal_end += data_size;
+    }
+    else if (data_size > 0)
+    {
+        memcpy(&b->journal_data[b->journal_length], data, data_size);
+        b->journal_length += data_size;
+    }
+    b->journal_unsynced = 1;
+    return;
+error:
+    buffer_journal_close(b);
+}
+
+// Makes the header of a journal for the file as it is now.
+static int buffer_journal_header(struct buffer* b, unsigned char* header)
+{
+    unsigned char* data = io_alloc(b->io, BUFFER_PAGE_SIZE);
+    unsigned long sum = 2166136261UL;
+    size_t size = (size_t)min(b->filesize, BUFFER_PAGE_SIZE);
+    offset_t modified;
+    offset_t id;
+    size_t i;
+    int last;
+
+    if (data == NULL || !buffer_file_flush(b))
+    {
+        free(data);
+        return 0;
+    }
+    for (last = 0; last < 2; last++)
+    {
+        if (size > 0
+            && !io_read(b->io, last ? b->filesize - size : 0, data, size))
+        {
+            free(data);
+            return 0;
+        }
+        for (i = 0; i < size; i++)
+        {
+            sum = ((sum ^ data[i]) * 16777619UL) & 0xFFFFFFFFUL;
+        }
+    }
+    free(data);
+    io_identity(b->io, &modified, &id);
+    memcpy(header, BUFFER_JOURNAL_MAGIC, 8);
+    journal_put(&header[8], b->filesize);
+    journal_put(&header[16], modified);
+    journal_put(&header[24], id);
+    journal_put(&header[32], sum);
+    return 1;
+}
+
+// Starts the journal afresh, for the file as it is now and what the
+// clipboard holds.
+static int buffer_journal_reset(struct buffer* b)
+{
+    unsigned char header[BUFFER_JOURNAL_HEADER];
+    size_t i;
+
+    if (b->journal_name == NULL)
+    {
+        return 0;
+    }
+    if (b->journal_data == NULL)
+    {
+        b->journal_data = malloc(BUFFER_JOURNAL_SIZE);
+    }
+    b->journal_length = 0;
+    b->journal_end = BUFFER_JOURNAL_HEADER;
+    b->journal_unsynced = 0;
+    if (b->journal_data == NULL
+        || !buffer_journal_header(b, header)
+        || !io_resize(&b->journal, 0)
+        || !io_write(&b->journal, 0, header, sizeof(header))
+        || !io_sync(&b->journal))
+    {
+        buffer_journal_close(b);
+        return 0;
+    }
+    for (i = 0; i < b->clipboard.piece_count; i++)
+    {
+        struct piece* p = &b->clipboard.pieces[i];
+
+        // A save leaves the clipboard's bytes in the add buffer:
+        if (p->kind == PIECE_ZERO)
+        {
+            buffer_journal_record(b, JOURNAL_CLIP_ZERO, 0, p->length, NULL);
+        }
+        else
+        {
+            buffer_journal_record(b, JOURNAL_CLIP, 0, p->length,
+                                  &b->add[p->source]);
+        }
+    }
+    return b->journal_name != NULL;
+}
+
+// Gets the edits journaled so far to the disk. Called when the user
+// pauses, so that a burst of typing costs one sync rather than one each.
+void buffer_journal_sync(struct buffer* b)
+{
+    if (b->journal_unsynced)
+    {
+        if (!buffer_journal_flush(b) || !io_sync(&b->journal))
+        {
+            buffer_journal_close(b);
+            return;
+        }
+        b->journal_unsynced = 0;
+    }
+}
+
+// Tells whether edits still wait for buffer_journal_sync().
+int buffer_journal_pending(struct buffer* b)
+{
+    return b->journal_unsynced;
+}
+
+void buffer_destroy(struct buffer* b)
+{
+    buffer_file_flush(b);
+    buffer_journal_close(b);
+#if defined(HAVE_ASYNC)
+    async_stop(&b->async);
+#endif
+#if defined(HAVE_MMAP)
+    buffer_unmap(b);
+#endif
+    free(b->buffer);
+    free(b->pages);
+    free(b->page_data);
+    buffer_clear_history(b);
+    free(b->clipboard.pieces);
+    free(b->changes);
+    free(b->pieces);
+    free(b->add);
+    free(b->span);
+    free(b->zeros);
+    b->io = NULL;
+    b->size = 0;
+    b->buffer = NULL;
+    b->pages = NULL;
+    b->page_data = NULL;
+    b->pieces = NULL;
+    b->piece_count = 0;
+    b->piece_capacity = 0;
+    b->changes = NULL;
+    b->change_capacity = 0;
+    b->clipboard.pieces = NULL;
+    b->clipboard.piece_count = 0;
+    b->clipboard.length = 0;
+    b->add = NULL;
+    b->add_length = 0;
+    b->add_capacity = 0;
+    b->span = NULL;
+    b->zeros = NULL;
+    b->page_count = 0;
+    b->page_size = 0;
+    b->clock = 0;
+    b->stream_count = 0;
+    b->stream_next = 0;
+    b->scanning = 0;
+    b->dirty_count = 0;
+    b->last = NULL;
+}
+
+int buffer_create(struct buffer* b, size_t size, struct io* io,
+        enum buffer_backend backend)
+{
+    b->io = io;
+    b->backend = backend;
+    b->readahead_last = 0;
+    b->readahead_until = 0;
+    b->readahead_size = 0;
+    b->readahead_direction = 0;
+    b->extent_valid = 0;
+    b->changes = NULL;
+    b->change_count = 0;
+    b->change_capacity = 0;
+    b->progress = NULL;
+    b->progress_done = 0;
+    b->progress_total = 0;
+    b->dirty_count = 0;
+    b->flush_failed = 0;
+    b->in_place = 0;
+    b->threads = 1;
+    b->damaged = 0;
+    b->journal_name = NULL;
+    b->journal_data = NULL;
+    b->journal_length = 0;
+    b->journal_unsynced = 0;
+    if (!io_size(b->io, &b->filesize))
+    {
+        goto error;
+    }
+    b->buffer = malloc(size);
+    b->span = malloc(size);
+    b->zeros = calloc(size, 1);
+    b->pieces = malloc(BUFFER_PIECE_COUNT * sizeof(*b->pieces));
+    if (b->buffer != NULL
+        && b->span != NULL
+        && b->zeros != NULL
+        && b->pieces != NULL)
+    {
+        unsigned long cache_size;
+        size_t i;
+
+        b->size = size;
+        b->piece_capacity = BUFFER_PIECE_COUNT;
+        b->add = NULL;
+        b->add_capacity = 0;
+        buffer_unedited(b);
+#if defined(HAVE_MMAP)
+        if (b->backend == BUFFER_MMAP)
+        {
+            struct sigaction sa;
+
+            // Map up front, so that files that cannot be mapped are
+            // rejected here rather than on first access.
+            if (b->filesize != 0
+                && !buffer_map(b, 0, min(b->size, b->filesize)))
+            {
+                goto error;
+            }
+            sigbus_page_size = sysconf(_SC_PAGESIZE);
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_sigaction = buffer_sigbus;
+            sa.sa_flags = SA_SIGINFO;
+            sigemptyset(&sa.sa_mask);
+            sigaction(SIGBUS, &sa, NULL);
+            return 1;
+        }
+#endif
+        b->page_size = max(BUFFER_PAGE_SIZE, b->io->align);
+        b->page_count = BUFFER_PAGE_COUNT;
+        b->stream_count = BUFFER_STREAM_PAGE_COUNT;
+        cache_size = (unsigned long)(b->page_count + b->stream_count)
+                     * b->page_size;
+        if (cache_size != (size_t)cache_size)
+        {
+            goto error;
+        }
+        b->pages = calloc(b->page_count + b->stream_count,
+                          sizeof(*b->pages));
+        b->page_data = io_alloc(b->io, (size_t)cache_size);
+        if (b->pages == NULL || b->page_data == NULL)
+        {
+            goto error;
+        }
+        for (i = 0; i < b->page_count + b->stream_count; i++)
+        {
+            b->pages[i].data = &b->page_data[i * b->page_size];
+        }
+        b->clock = 0;
+        b->stream_next = 0;
+        b->last = NULL;
+        b->hits = 0;
+        b->misses = 0;
+#if defined(HAVE_ASYNC)
+        async_start(&b->async, b->io);
+#endif
+        if (b->filesize == 0 || buffer_page(b, 0) != NULL)
+        {
+            return 1;
+        }
+    }
+error:
+    buffer_destroy(b);
+    return 0;
+}
+
+unsigned char* buffer_file_access(struct buffer* b, offset_t offset, size_t size)
+{
+    struct page* p;
+    offset_t end;
+    offset_t o;
+
+    if (size > b->size)
+    {
+        return NULL;
+    }
+#if defined(HAVE_MMAP)
+    if (buffer_truncated)
+    {
+        buffer_remap(b);
+    }
+#endif
+    if (offset >= b->filesize)
+    {
+        return NULL;
+    }
+#if defined(HAVE_MMAP)
+    if (b->backend == BUFFER_MMAP)
+    {
+        // Zero-copy: hand out a pointer straight into the mapping.
+        if (!buffer_map(b, offset, min(size, b->filesize - offset)))
+        {
+            return NULL;
+        }
+        return &b->map[offset - b->map_offset];
+    }
+#endif
+    end = min(offset + size, b->filesize);
+    o = offset - offset % b->page_size;
+    if ((p = buffer_page(b, o)) == NULL)
+    {
+        return NULL;
+    }
+    if (end <= o + b->page_size)
+    {
+        return &p->data[offset - o];
+    }
+    // The span crosses pages, so assemble a contiguous copy:
+    memcpy(b->buffer, &p->data[offset - o], o + b->page_size - offset);
+    for (o += b->page_size; o < end; o += b->page_size)
+    {
+        if ((p = buffer_page(b, o)) == NULL)
+        {
+            return NULL;
+        }
+        memcpy(&b->buffer[o - offset], p->data, min(b->page_size, end - o));
+    }
+    return b->buffer;
+}
+
+// Like buffer_file_access(), but returns NULL rather than block, with the
+// data requested in the background. Retry after buffer_poll().
+unsigned char* buffer_file_peek(struct buffer* b, offset_t offset, size_t size)
+{
+    offset_t end;
+    int ready = 1;
+
+    if (size > b->size || offset >= b->filesize)
+    {
+        return buffer_file_access(b, offset, size);
+    }
+    end = min(offset + size, b->filesize);
+#if defined(HAVE_ASYNC)
+    if (b->backend == BUFFER_READ && b->async.engine != ASYNC_NONE)
+    {
+        offset_t o;
+
+        for (o = offset - offset % b->page_size; o < end; o += b->page_size)
+        {
+            struct page* p = buffer_lookup(b, o);
+            if (p == NULL)
+            {
+                p = buffer_evict(b);
+                p->offset = o;
+                p->length = min(b->page_size, b->filesize - o);
+                p->state = PAGE_LOADING;
+                p->stale = 0;
+                p->referenced = 1;
+                if (!async_submit(&b->async, o, p->data, p->length, p))
+                {
+                    p->state = PAGE_EMPTY;
+                    if (b->async.pending == 0)
+                    {
+                        return buffer_file_access(b, offset, size);
+                    }
+                }
+                ++b->misses;
+            }
+            ready &= p->state == PAGE_VALID;
+        }
+        return ready ? buffer_file_access(b, offset, size) : NULL;
+    }
+#endif
+#if defined(HAVE_MMAP) && defined(__linux__)
+    if (b->backend == BUFFER_MMAP
+        && b->map_waits < BUFFER_MAP_WAITS
+        && buffer_map(b, offset, end - offset))
+    {
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t skew = (offset - b->map_offset) % page_size;
+        size_t pages = (skew + (end - offset) + page_size - 1) / page_size;
+        unsigned char resident[4];
+        size_t i;
+
+        if (pages <= sizeof(resident)
+            && mincore(&b->map[offset - skew - b->map_offset],
+                       skew + (end - offset), resident) == 0)
+        {
+            for (i = 0; i < pages; i++)
+            {
+                ready &= resident[i] & 1;
+            }
+            if (!ready)
+            {
+                posix_madvise(&b->map[offset - skew - b->map_offset],
+                              skew + (end - offset), POSIX_MADV_WILLNEED);
+                b->map_waiting = 1;
+                return NULL;
+            }
+        }
+    }
+#endif
+    (void)end;
+    (void)ready;
+    return buffer_file_access(b, offset, size);
+}
+
+// Tells whether offset lies in a hole of a sparse file, and where the
+// extent it lies in ends. The last extent looked up is remembered.
+static int buffer_file_hole(struct buffer* b, offset_t offset, offset_t* end)
+{
+    if (!b->extent_valid
+        || offset < b->extent_offset
+        || offset >= b->extent_end)
+    {
+        io_extent(b->io, offset, b->filesize, &b->extent_hole,
+                  &b->extent_end);
+        b->extent_offset = offset;
+        b->extent_valid = 1;
+    }
+    *end = min(b->extent_end, b->filesize);
+    return b->extent_hole;
+}
+
+// Finds the start of the hole that contains offset and ends at end. There
+// is no seek for that, so probe backwards in growing steps, then bisect.
+static offset_t buffer_file_hole_start(struct buffer* b, offset_t offset,
+        offset_t end)
+{
+    offset_t step = BUFFER_PAGE_SIZE;
+    offset_t data;
+    offset_t e;
+    int hole;
+
+    for (;;)
+    {
+        if (offset == 0)
+        {
+            return 0;
+        }
+        data = offset > step ? offset - step : 0;
+        io_extent(b->io, data, b->filesize, &hole, &e);
+        if (!hole || e != end)
+        {
+            break;
+        }
+        offset = data;
+        step *= 2;
+    }
+    // Data (or another hole) at data, our hole from somewhere after it up
+    // to offset:
+    while (offset - data > 1)
+    {
+        offset_t middle = data + (offset - data) / 2;
+        io_extent(b->io, middle, b->filesize, &hole, &e);
+        if (hole && e == end)
+        {
+            offset = middle;
+        }
+        else
+        {
+            data = middle;
+        }
+    }
+    return offset;
+}
+
+#if defined(HAVE_MMAP)
+static int buffer_map_write(struct buffer* b, offset_t offset, size_t size,
+        unsigned char* data)
+{
+    offset_t o;
+
+    for (o = 0; o < size; o += b->size)
+    {
+        size_t chunksize = min(size - o, b->size);
+        unsigned char* chunk = &data[o];
+
+        // Remapping would pull the rug from under data that points into
+        // the current window, so bounce it through the scratch buffer.
+        if (b->map != NULL
+            && chunk >= b->map && chunk < b->map + b->map_size
+            && (offset + o < b->map_offset
+                || offset + o + chunksize > b->map_offset + b->map_size))
+        {
+            memcpy(b->buffer, chunk, chunksize);
+            chunk = b->buffer;
+        }
+        if (!buffer_map(b, offset + o, chunksize))
+        {
+            return 0;
+        }
+        memmove(&b->map[offset + o - b->map_offset], chunk, chunksize);
+    }
+    return 1;
+}
+#endif
+
+// Writing to a hole allocates it, data extents stay as they are.
+static void buffer_extent_written(struct buffer* b, offset_t offset,
+        offset_t size)
+{
+    if (b->extent_valid
+        && b->extent_hole
+        && offset < b->extent_end
+        && offset + size > b->extent_offset)
+    {
+        b->extent_valid = 0;
+    }
+}
+
+// Catches up with data written to the file.
+static void buffer_file_written(struct buffer* b, offset_t offset,
+        offset_t size)
+{
+    buffer_extent_written(b, offset, size);
+    // Pages changed on disk are re-read on their next access:
+    buffer_invalidate_range(b, offset, size);
+}
+
+// Patches a write into the cached pages for buffer_page_flush() to write
+// back, so that runs of small edits take one write.
+static int buffer_page_write(struct buffer* b, offset_t offset, size_t size,
+        unsigned char* data)
+{
+    buffer_extent_written(b, offset, size);
+    while (size > 0)
+    {
+        offset_t start = offset - offset % b->page_size;
+        size_t at = (size_t)(offset - start);
+        size_t chunk = min(size, b->page_size - at);
+        struct page* p;
+
+        if (start >= b->filesize
+            || (p = buffer_page(b, start)) == NULL
+            || at + chunk > p->length)
+        {
+            return 0;
+        }
+        memcpy(&p->data[at], data, chunk);
+        if (p->dirty_start == p->dirty_end)
+        {
+            p->dirty_start = at;
+            p->dirty_end = at + chunk;
+            ++b->dirty_count;
+        }
+        else
+        {
+            p->dirty_start = min(p->dirty_start, at);
+            p->dirty_end = max(p->dirty_end, at + chunk);
+        }
+        offset += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    return 1;
+}
+
+int buffer_file_write(struct buffer* b, offset_t offset, size_t size,
+        unsigned char* data)
+{
+    if (b->io->readonly)
+    {
+        return 0;
+    }
+#if defined(HAVE_MMAP)
+    if (b->backend == BUFFER_MMAP)
+    {
+        buffer_file_written(b, offset, size);
+        return buffer_map_write(b, offset, size, data);
+    }
+#endif
+    // Less than a page goes through the cache, see buffer_page_write():
+    if (size < b->page_size && buffer_page_write(b, offset, size, data))
+    {
+        return 1;
+    }
+    if (!buffer_file_flush(b) || !io_write(b->io, offset, data, size))
+    {
+        return 0;
+    }
+    buffer_file_written(b, offset, size);
+    return 1;
+}
+
+// Grow (with zeros) or shrink the file to the given size.
+static int buffer_file_resize(struct buffer* b, offset_t filesize)
+{
+    if (b->io->readonly)
+    {
+        return 0;
+    }
+#if defined(HAVE_MMAP)
+    // Never leave a mapping hanging past the end of the file.
+    buffer_unmap(b);
+#endif
+    if (!buffer_file_flush(b) || !io_resize(b->io, filesize))
+    {
+        return 0;
+    }
+    // Only the pages around the old and the new end of file are affected:
+    buffer_invalidate_range(b,
+                            min(b->filesize, filesize),
+                            max(b->filesize, filesize)
+                                - min(b->filesize, filesize));
+    b->filesize = filesize;
+    b->extent_valid = 0;
+    return 1;
+}
+
+// Inserts a hole of size bytes at offset or collapses the size bytes there,
+// see io_shift().
+static int buffer_file_shift(struct buffer* b, offset_t offset, offset_t size,
+        int collapse)
+{
+    if (b->io->readonly)
+    {
+        return 0;
+    }
+#if defined(HAVE_MMAP)
+    buffer_unmap(b);
+#endif
+    if (!buffer_file_flush(b) || !io_shift(b->io, offset, size, collapse))
+    {
+        return 0;
+    }
+    // Everything from offset on has moved:
+    buffer_invalidate_range(b, offset, (offset_t)-1 - offset);
+    b->filesize = collapse ? b->filesize - size : b->filesize + size;
+    b->extent_valid = 0;
+    return 1;
+}
+
+// Zeroes a range of the file, by punching a hole where the file system
+// supports that.
+static int buffer_file_zero(struct buffer* b, offset_t offset, offset_t size)
+{
+    offset_t o;
+
+    if (!buffer_file_flush(b))
+    {
+        return 0;
+    }
+    if (io_punch(b->io, offset, size))
+    {
+        buffer_invalidate_range(b, offset, size);
+        b->extent_valid = 0;
+        return 1;
+    }
+    memset(b->buffer, 0, b->size);
+    for (o = 0; o < size; o += b->size)
+    {
+        if (!buffer_file_write(b, offset + o, min(size - o, b->size), b->buffer))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Counts size more bytes of a long operation done, and reports that.
+// Returns 0 when the operation is to be cancelled.
+static int buffer_progress(struct buffer* b, offset_t size)
+{
+    b->progress_done += size;
+    return b->progress == NULL
+        || b->progress_total == 0
+        || b->progress(b, b->progress_done, b->progress_total);
+}
+
+// A chunk of a move: a hole, or data that is copied by the system or read
+// (in the background where possible) and written.
+struct move_chunk
+{
+    offset_t source;
+    offset_t size;
+    int hole;
+    int copy;
+    int pending;
+    int ok;
+    unsigned char* data;
+};
+
+// Picks the chunk of a move after the first done bytes, in the direction
+// the overlap requires, and starts reading it where needed.
+static void buffer_move_chunk(struct buffer* b, offset_t from, offset_t to,
+        offset_t size, offset_t done, int copy, int async,
+        unsigned char* data, struct move_chunk* c)
+{
+    offset_t hole_end;
+
+    c->size = min(size - done, BUFFER_MOVE_SIZE);
+    if (to > from)
+    {
+        offset_t source_end = from + size - done;
+
+        c->source = source_end - c->size;
+        if (buffer_file_hole(b, source_end - 1, &hole_end))
+        {
+            c->source = max(from, buffer_file_hole_start(b, source_end - 1,
+                                                         hole_end));
+            c->size = source_end - c->source;
+        }
+    }
+    else
+    {
+        c->source = from + done;
+        if (buffer_file_hole(b, c->source, &hole_end))
+        {
+            c->size = min(hole_end, from + size) - c->source;
+        }
+        else
+        {
+            c->size = min(c->size, hole_end - c->source);
+        }
+    }
+    c->hole = buffer_file_hole(b, c->source, &hole_end)
+        && hole_end >= c->source + c->size;
+    // The system copies between ranges that do not overlap:
+    c->copy = copy && (to > from ? to - from : from - to) >= c->size;
+    c->pending = 0;
+    c->ok = 0;
+    c->data = data;
+#if defined(HAVE_ASYNC)
+    if (async && !c->hole && !c->copy)
+    {
+        c->pending = async_submit(&b->async, c->source, data,
+                                  (size_t)c->size, c);
+    }
+#else
+    (void)async;
+#endif
+}
+
+// Waits for the chunk's data to arrive, or reads it now.
+static int buffer_move_read(struct buffer* b, struct move_chunk* c)
+{
+#if defined(HAVE_ASYNC)
+    void* tag;
+    int ok;
+
+    while (c->pending)
+    {
+        async_wait(&b->async);
+        while (async_reap(&b->async, &tag, &ok))
+        {
+            struct move_chunk* landed = tag;
+            landed->pending = 0;
+            landed->ok = ok;
+        }
+    }
+#endif
+    return c->ok || io_read(b->io, c->source, c->data, (size_t)c->size);
+}
+
+// Copies size bytes within the file, in the direction the overlap
+// requires. Holes are zeroed rather than read. *moved tells how many bytes
+// are in place, also when it fails or is cancelled.
+static int buffer_file_move(struct buffer* b, offset_t from, offset_t to,
+        offset_t size, offset_t* moved)
+{
+    struct move_chunk chunks[2];
+    unsigned char* data[2];
+    size_t data_size = (size_t)max(min(size, BUFFER_MOVE_SIZE), 1);
+    int copy = 1;
+    int async = 0;
+    int i;
+    int result = 0;
+
+    *moved = 0;
+    if (b->io->readonly || !buffer_file_flush(b))
+    {
+        return 0;
+    }
+    data[0] = io_alloc(b->io, data_size);
+    data[1] = io_alloc(b->io, data_size);
+    if (data[0] == NULL || data[1] == NULL)
+    {
+        goto done;
+    }
+#if defined(HAVE_ASYNC)
+    if (b->backend == BUFFER_READ && b->async.engine != ASYNC_NONE)
+    {
+        // Land the fills in flight, so that all that completes is ours:
+        while (b->async.pending > 0)
+        {
+            async_wait(&b->async);
+            buffer_poll(b);
+        }
+        async = 1;
+    }
+#endif
+    if (size > 0)
+    {
+        buffer_move_chunk(b, from, to, size, 0, copy, async, data[0],
+                          &chunks[0]);
+    }
+    for (i = 0; *moved < size; i ^= 1)
+    {
+        struct move_chunk* c = &chunks[i];
+        offset_t target = c->source - from + to;
+
+        // The next chunk's source lies beyond what this one overwrites, so
+        // it can be read in the meantime.
+        if (*moved + c->size < size)
+        {
+            buffer_move_chunk(b, from, to, size, *moved + c->size, copy,
+                              async, data[i ^ 1], &chunks[i ^ 1]);
+        }
+        if (c->hole)
+        {
+            if (!buffer_file_zero(b, target, c->size))
+            {
+                goto done;
+            }
+        }
+        else
+        {
+            if (!c->copy
+                || !copy
+                || !io_copy(b->io, c->source, b->io, target, c->size))
+            {
+                // Once the system fails to copy, go through memory:
+                copy = copy && !c->copy;
+                if (!buffer_move_read(b, c)
+                    || !io_write(b->io, target, c->data, (size_t)c->size))
+                {
+                    goto done;
+                }
+            }
+            buffer_file_written(b, target, c->size);
+        }
+        *moved += c->size;
+        if (!buffer_progress(b, c->size))
+        {
+            goto done;
+        }
+    }
+    result = 1;
+done:
+#if defined(HAVE_ASYNC)
+    // Our buffers must not be written once they are gone:
+    while (async && b->async.pending > 0)
+    {
+        void* tag;
+        int ok;
+
+        async_wait(&b->async);
+        while (async_reap(&b->async, &tag, &ok))
+        {
+        }
+    }
+#endif
+    free(data[0]);
+    free(data[1]);
+    return result;
+}
+
+// Makes room for count pieces in the table.
+static int buffer_reserve(struct buffer* b, size_t count)
+{
+    size_t capacity = b->piece_capacity;
+    struct piece* pieces;
+
+    if (count <= capacity)
+    {
+        return 1;
+    }
+    while (capacity < count)
+    {
+        capacity *= 2;
+    }
+    pieces = realloc(b->pieces, capacity * sizeof(*pieces));
+    if (pieces == NULL)
+    {
+        return 0;
+    }
+    b->pieces = pieces;
+    b->piece_capacity = capacity;
+    return 1;
+}
+
+// Makes room for size more bytes at the end of the add buffer, and returns
+// where they go.
+static unsigned char* buffer_add_room(struct buffer* b, size_t size)
+{
+    if (size > (size_t)-1 / 2 - b->add_length)
+    {
+        return NULL;
+    }
+    if (b->add_length + size > b->add_capacity || b->add == NULL)
+    {
+        size_t capacity = max(b->add_capacity, BUFFER_ADD_SIZE);
+        unsigned char* add;
+
+        while (capacity < b->add_length + size)
+        {
+            capacity *= 2;
+        }
+        add = realloc(b->add, capacity);
+        if (add == NULL)
+        {
+            return NULL;
+        }
+        b->add = add;
+        b->add_capacity = capacity;
+    }
+    return &b->add[b->add_length];
+}
+
+// Appends bytes to the add buffer, and tells where they went.
+static int buffer_append(struct buffer* b, const unsigned char* data,
+        size_t size, offset_t* source)
+{
+    unsigned char* room = buffer_add_room(b, size);
+
+    if (room == NULL)
+    {
+        return 0;
+    }
+    memcpy(room, data, size);
+    *source = b->add_length;
+    b->add_length += size;
+    return 1;
+}
+
+// Splits the piece that contains offset in two, so that a piece starts
+// there. Returns the index of that piece. There must be room for one more.
+static size_t buffer_split(struct buffer* b, offset_t offset)
+{
+    size_t i = buffer_piece(b, offset);
+    struct piece* p = &b->pieces[i];
+    offset_t head;
+
+    if (i == b->piece_count || p->offset == offset)
+    {
+        return i;
+    }
+    head = offset - p->offset;
+    memmove(p + 2, p + 1, (b->piece_count - i - 1) * sizeof(*p));
+    p[1] = p[0];
+    p[0].length = head;
+    p[1].offset = offset;
+    p[1].length -= head;
+    p[1].source += head;
+    ++b->piece_count;
+    return i + 1;
+}
+
+// Joins the piece at index i to the one before, where the bytes of the
+// second continue those of the first.
+static void buffer_merge(struct buffer* b, size_t i)
+{
+    struct piece* p = &b->pieces[i];
+
+    if (i == 0
+        || i >= b->piece_count
+        || p[-1].kind != p->kind
+        || (p->kind != PIECE_ZERO && p[-1].source + p[-1].length != p->source))
+    {
+        return;
+    }
+    p[-1].length += p->length;
+    memmove(p, p + 1, (b->piece_count - i - 1) * sizeof(*p));
+    --b->piece_count;
+}
+
+// Replaces length bytes at offset with the given pieces, whose offsets are
+// filled in here. All edits come down to this; it only changes the table.
+static int buffer_splice(struct buffer* b, offset_t offset, offset_t length,
+        const struct piece* pieces, size_t count)
+{
+    size_t first;
+    size_t last;
+    size_t i;
+    offset_t o;
+
+    if (b->io->readonly)
+    {
+        return 0;
+    }
+    offset = min(offset, b->length);
+    length = min(length, b->length - offset);
+    if (!buffer_reserve(b, b->piece_count + count + 2))
+    {
+        return 0;
+    }
+    first = buffer_split(b, offset);
+    last = buffer_split(b, offset + length);
+    memmove(&b->pieces[first + count], &b->pieces[last],
+            (b->piece_count - last) * sizeof(*b->pieces));
+    b->piece_count = b->piece_count - (last - first) + count;
+    for (i = 0, o = offset; i < count; i++)
+    {
+        b->pieces[first + i] = pieces[i];
+        b->pieces[first + i].offset = o;
+        o += pieces[i].length;
+    }
+    for (i = first + count; i < b->piece_count; i++)
+    {
+        b->pieces[i].offset = b->pieces[i].offset - length + (o - offset);
+    }
+    b->length = b->length - length + (o - offset);
+    // The seam behind the new pieces first, so that first stays valid:
+    buffer_merge(b, first + count);
+    buffer_merge(b, first);
+    b->modified = 1;
+    return 1;
+}
+
+// Appends the pieces that make up length bytes at offset to a change, as
+// what it replaced.
+static int buffer_capture(struct buffer* b, offset_t offset, offset_t length,
+        struct change* c)
+{
+    size_t i;
+    offset_t end = offset + length;
+
+    for (i = buffer_piece(b, offset); offset < end; i++)
+    {
+        struct piece p = b->pieces[i];
+        offset_t skip = offset - p.offset;
+        size_t n = c->piece_count;
+
+        p.source += skip;
+        p.length = min(p.length - skip, end - offset);
+        offset += p.length;
+        if (n > 0
+            && c->pieces[n - 1].kind == p.kind
+            && (p.kind == PIECE_ZERO
+                || c->pieces[n - 1].source + c->pieces[n - 1].length
+                    == p.source))
+        {
+            c->pieces[n - 1].length += p.length;
+            continue;
+        }
+        // Room for twice as many whenever a power of two is reached:
+        if (n == 0 || (n >= BUFFER_CHANGE_PIECES && (n & (n - 1)) == 0))
+        {
+            struct piece* pieces = realloc(c->pieces,
+                max(2 * n, BUFFER_CHANGE_PIECES) * sizeof(*pieces));
+            if (pieces == NULL)
+            {
+                return 0;
+            }
+            c->pieces = pieces;
+        }
+        c->pieces[c->piece_count++] = p;
+        ++b->history_pieces;
+    }
+    return 1;
+}
+
+static void buffer_forget(struct change* c)
+{
+    free(c->pieces);
+    c->pieces = NULL;
+    c->piece_count = 0;
+}
+
+// Drops the oldest changes while the history holds too many pieces.
+static void buffer_trim_history(struct buffer* b)
+{
+    while (b->history_pieces > BUFFER_HISTORY_PIECES && b->undo_count > 1)
+    {
+        b->history_pieces -= b->changes[0].piece_count;
+        buffer_forget(&b->changes[0]);
+        memmove(&b->changes[0], &b->changes[1],
+                (b->change_count - 1) * sizeof(*b->changes));
+        --b->change_count;
+        --b->undo_count;
+        b->history_lost = 1;
+    }
+}
+
+// Makes an edit that can be undone. Consecutive typing extends the last
+// change.
+static int buffer_edit(struct buffer* b, offset_t offset, offset_t length,
+        const struct piece* pieces, size_t count, int typing)
+{
+    struct change* c = NULL;
+    struct change undo;
+    offset_t inserted = 0;
+    size_t i;
+
+    if (b->io->readonly)
+    {
+        return 0;
+    }
+    offset = min(offset, b->length);
+    length = min(length, b->length - offset);
+    for (i = 0; i < count; i++)
+    {
+        inserted += pieces[i].length;
+    }
+    if (length == 0 && inserted == 0)
+    {
+        return 1;
+    }
+    // With room made up front the splice cannot fail after the history
+    // has been updated:
+    if (!buffer_reserve(b, b->piece_count + count + 2))
+    {
+        return 0;
+    }
+    if (b->typing && b->undo_count > 0 && b->undo_count == b->change_count)
+    {
+        c = &b->changes[b->undo_count - 1];
+    }
+    if (c != NULL && offset >= c->offset && offset <= c->offset + c->length)
+    {
+        // Take in what the edit removes past the end of the change:
+        offset_t end = c->offset + c->length;
+        offset_t extra = offset + length > end ? offset + length - end : 0;
+
+        if (!buffer_capture(b, end, extra, c))
+        {
+            return 0;
+        }
+        buffer_splice(b, offset, length, pieces, count);
+        c->length = c->length + extra - length + inserted;
+    }
+    else
+    {
+        if (b->change_count == b->change_capacity)
+        {
+            size_t capacity = max(2 * b->change_capacity,
+                                  BUFFER_CHANGE_COUNT);
+            struct change* changes = realloc(b->changes,
+                                             capacity * sizeof(*changes));
+            if (changes == NULL)
+            {
+                return 0;
+            }
+            b->changes = changes;
+            b->change_capacity = capacity;
+        }
+        undo.offset = offset;
+        undo.length = inserted;
+        undo.pieces = NULL;
+        undo.piece_count = 0;
+        if (!buffer_capture(b, offset, length, &undo))
+        {
+            b->history_pieces -= undo.piece_count;
+            buffer_forget(&undo);
+            return 0;
+        }
+        buffer_splice(b, offset, length, pieces, count);
+        // A new edit ends what could be redone:
+        while (b->change_count > b->undo_count)
+        {
+            c = &b->changes[--b->change_count];
+            b->history_pieces -= c->piece_count;
+            buffer_forget(c);
+        }
+        b->changes[b->change_count++] = undo;
+        b->undo_count = b->change_count;
+        buffer_trim_history(b);
+    }
+    b->typing = typing;
+    return 1;
+}
+
+// Applies a change from the history, and replaces it by its inverse.
+static int buffer_apply(struct buffer* b, struct change* c)
+{
+    struct change inverse;
+    size_t i;
+
+    inverse.offset = c->offset;
+    inverse.length = 0;
+    inverse.pieces = NULL;
+    inverse.piece_count = 0;
+    for (i = 0; i < c->piece_count; i++)
+    {
+        inverse.length += c->pieces[i].length;
+    }
+    if (!buffer_reserve(b, b->piece_count + c->piece_count + 2)
+        || !buffer_capture(b, c->offset, c->length, &inverse))
+    {
+        b->history_pieces -= inverse.piece_count;
+        buffer_forget(&inverse);
+        return 0;
+    }
+    buffer_splice(b, c->offset, c->length, c->pieces, c->piece_count);
+    b->history_pieces -= c->piece_count;
+    buffer_forget(c);
+    *c = inverse;
+    b->typing = 0;
+    b->modified = b->undo_count > 0 || b->history_lost;
+    return 1;
+}
+
+// Where the bytes of a piece at offset are: in the file, in the add
+// buffer, or nowhere for zeros.
+static unsigned char* buffer_source(struct buffer* b, struct piece* p,
+        offset_t offset, size_t size, int peek)
+{
+    offset_t source = p->source + (offset - p->offset);
+
+    switch (p->kind)
+    {
+        case PIECE_FILE:
+            return peek
+                ? buffer_file_peek(b, source, size)
+                : buffer_file_access(b, source, size);
+
+        case PIECE_ADD:
+            return &b->add[source];
+
+        case PIECE_ZERO:
+            break;
+    }
+    return b->zeros;
+}
+
+static unsigned char* buffer_span(struct buffer* b, offset_t offset,
+        size_t size, int peek)
+{
+    size_t i;
+    offset_t end;
+    offset_t o;
+
+    if (size > b->size || offset >= b->length)
+    {
+        return NULL;
+    }
+    end = min(offset + size, b->length);
+    i = buffer_piece(b, offset);
+    if (end <= b->pieces[i].offset + b->pieces[i].length)
+    {
+        return buffer_source(b, &b->pieces[i], offset, end - offset, peek);
+    }
+    // The span crosses pieces, so assemble a contiguous copy:
+    for (o = offset; o < end; i++)
+    {
+        struct piece* p = &b->pieces[i];
+        size_t n = min(end, p->offset + p->length) - o;
+        unsigned char* data = buffer_source(b, p, o, n, peek);
+
+        if (data == NULL)
+        {
+            return NULL;
+        }
+        memcpy(&b->span[o - offset], data, n);
+        o += n;
+    }
+    return b->span;
+}
+
+// Returns size bytes of the edited contents at offset, fewer at the end.
+// The data stays valid until the next call into the buffer.
+unsigned char* buffer_access(struct buffer* b, offset_t offset, size_t size)
+{
+    return buffer_span(b, offset, size, 0);
+}
+
+// Like buffer_access(), but returns NULL rather than wait for the file,
+// see buffer_file_peek().
+unsigned char* buffer_peek(struct buffer* b, offset_t offset, size_t size)
+{
+    return buffer_span(b, offset, size, 1);
+}
+
+// Tells whether offset lies in zeros stored nowhere, and where its piece
+// ends.
+static int buffer_hole(struct buffer* b, offset_t offset, offset_t* end)
+{
+    size_t i = buffer_piece(b, offset);
+    struct piece* p = &b->pieces[i];
+    offset_t e;
+    int hole;
+
+    if (i == b->piece_count)
+    {
+        *end = b->length;
+        return 0;
+    }
+    *end = p->offset + p->length;
+    switch (p->kind)
+    {
+        case PIECE_FILE:
+            hole = buffer_file_hole(b, p->source + (offset - p->offset), &e);
+            *end = min(*end, e - p->source + p->offset);
+            return hole;
+
+        case PIECE_ADD:
+            break;
+
+        case PIECE_ZERO:
+            return 1;
+    }
+    return 0;
+}
+
+// Finds the start of the hole that contains offset.
+static offset_t buffer_hole_start(struct buffer* b, offset_t offset)
+{
+    struct piece* p = &b->pieces[buffer_piece(b, offset)];
+    offset_t source = p->source + (offset - p->offset);
+    offset_t end;
+
+    if (p->kind != PIECE_FILE)
+    {
+        return p->offset;
+    }
+    buffer_file_hole(b, source, &end);
+    source = buffer_file_hole_start(b, source, end);
+    return source > p->source ? source - p->source + p->offset : p->offset;
+}
+
+// Finds the start of the next data extent after offset.
+int buffer_next_data(struct buffer* b, offset_t offset, offset_t* data)
+{
+    offset_t end;
+
+    // Past the data at offset, then past the holes after it:
+    while (offset < b->length && !buffer_hole(b, offset, &end))
+    {
+        offset = end;
+    }
+    while (offset < b->length && buffer_hole(b, offset, &end))
+    {
+        offset = end;
+    }
+    if (offset >= b->length)
+    {
+        return 0;
+    }
+    *data = offset;
+    return 1;
+}
+
+// A block of the file read for a scan, see buffer_block().
+struct scan
+{
+    unsigned char* data;    // BUFFER_MOVE_SIZE bytes, or NULL.
+    offset_t offset;
+    size_t length;
+};
+
+// Returns where the run of the contents at offset (backwards, ending at
+// it) is in memory, and in *size how long it is, until the next call.
+static unsigned char* buffer_block(struct buffer* b, struct scan* scan,
+        offset_t offset, int backwards, size_t* size)
+{
+    struct piece* p = &b->pieces[buffer_piece(b, offset)];
+    // The run in the contents, and where its first byte is:
+    offset_t start = backwards ? p->offset : offset;
+    offset_t end = backwards ? offset + 1 : p->offset + p->length;
+    offset_t source = p->source + (offset - p->offset);
+    offset_t low;
+    offset_t high;
+    unsigned char* data;
+
+    switch (p->kind)
+    {
+        case PIECE_ADD:
+            data = &b->add[source];
+            break;
+
+        case PIECE_ZERO:
+            // As many as b->zeros holds:
+            if (backwards)
+            {
+                start = max(start, end - min(end, b->size));
+            }
+            else
+            {
+                end = min(end, start + b->size);
+            }
+            *size = (size_t)(end - start);
+            return b->zeros;
+
+        default:
+            if (scan->data != NULL && b->backend == BUFFER_READ)
+            {
+                if (source < scan->offset
+                    || source >= scan->offset + scan->length)
+                {
+                    scan->offset = source - source % BUFFER_MOVE_SIZE;
+                    scan->length = (size_t)min(b->filesize - scan->offset,
+                                               BUFFER_MOVE_SIZE);
+                    if (!buffer_file_flush(b)
+                        || !io_read(b->io, scan->offset, scan->data,
+                                    scan->length))
+                    {
+                        scan->length = 0;
+                        return NULL;
+                    }
+                }
+                data = &scan->data[source - scan->offset];
+                low = scan->offset;
+                high = scan->offset + scan->length;
+            }
+            else
+            {
+                if ((data = buffer_file_access(b, source, 1)) == NULL)
+                {
+                    return NULL;
+                }
+#if defined(HAVE_MMAP)
+                if (b->backend == BUFFER_MMAP)
+                {
+                    low = b->map_offset;
+                    high = b->map_offset + b->map_size;
+                }
+                else
+#endif
+                {
+                    low = source - source % b->page_size;
+                    high = low + b->page_size;
+                }
+                high = min(high, b->filesize);
+            }
+            // What of that lies in the piece:
+            start = max(start, offset - (source - max(low, p->source)));
+            end = min(end, offset + (high - source));
+            break;
+    }
+    *size = (size_t)min(end - start, (size_t)-1);
+    return data - (offset - start);
+}
+
+// Copies size bytes of the contents at offset.
+static int buffer_read(struct buffer* b, offset_t offset, size_t size,
+        unsigned char* data)
+{
+    size_t done;
+
+    for (done = 0; done < size; done += min(size - done, b->size))
+    {
+        unsigned char* span = buffer_access(b, offset + done,
+                                            min(size - done, b->size));
+        if (span == NULL)
+        {
+            return 0;
+        }
+        memcpy(&data[done], span, min(size - done, b->size));
+    }
+    return 1;
+}
+
+enum buffer_search_direction
+{
+    BUFFER_FORWARD,
+    BUFFER_BACKWARD
+};
+
+// Shorter patterns are found with memchr() on their first byte, longer
+// ones with Horspool's algorithm.
+#define SEARCH_HORSPOOL_LENGTH 4
+
+// Horspool's shifts: how far the pattern can move on, by the byte of the
+// text under its last byte, or going backwards its first.
+static void search_shifts(const unsigned char* pattern, size_t length,
+        enum buffer_search_direction d, size_t* shift)
+{
+    size_t i;
+
+    for (i = 0; i < 256; i++)
+    {
+        shift[i] = length;
+    }
+    if (d == BUFFER_FORWARD)
+    {
+        for (i = 0; i + 1 < length; i++)
+        {
+            shift[pattern[i]] = length - 1 - i;
+        }
+    }
+    else
+    {
+        for (i = length - 1; i > 0; i--)
+        {
+            shift[pattern[i]] = i;
+        }
+    }
+}
+
+// Finds the first, or going backwards the last, match that lies within
+// size bytes of text. Returns where it starts, or size where there is none.
+static size_t search_scalar(const unsigned char* text, size_t size,
+        const unsigned char* pattern, size_t length, const size_t* shift,
+        enum buffer_search_direction d)
+{
+    const unsigned char* t;
+    size_t s;
+
+    if (size < length)
+    {
+        return size;
+    }
+#if defined(HAVE_MEMRCHR)
+    if (d == BUFFER_BACKWARD && length < SEARCH_HORSPOOL_LENGTH)
+    {
+        for (s = size - length + 1;
+             (t = memrchr(text, pattern[0], s)) != NULL;
+             s = t - text)
+        {
+            if (memcmp(t + 1, &pattern[1], length - 1) == 0)
+            {
+                return t - text;
+            }
+        }
+        return size;
+    }
+#endif
+    if (d == BUFFER_BACKWARD)
+    {
+        for (s = size - length; ; s -= shift[text[s]])
+        {
+            if (text[s] == pattern[0]
+                && memcmp(&text[s + 1], &pattern[1], length - 1) == 0)
+            {
+                return s;
+            }
+            if (s < shift[text[s]])
+            {
+                return size;
+            }
+        }
+    }
+    if (length < SEARCH_HORSPOOL_LENGTH)
+    {
+        for (t = text;
+             (t = memchr(t, pattern[0], size - length + 1 - (t - text)))
+                != NULL;
+             t++)
+        {
+            if (memcmp(t + 1, &pattern[1], length - 1) == 0)
+            {
+                return t - text;
+            }
+            if (t == &text[size - length])
+            {
+                break;
+            }
+        }
+        return size;
+    }
+    for (s = 0; s <= size - length; s += shift[text[s + length - 1]])
+    {
+        if (text[s + length - 1] == pattern[length - 1]
+            && memcmp(&text[s], pattern, length - 1) == 0)
+        {
+            return s;
+        }
+    }
+    return size;
+}
+
+#if defined(HAVE_SSE2)
+// Patterns from 2 bytes up to this long are filtered with SIMD.
+#define SEARCH_SIMD_LENGTH 32
+
+static int lowest_bit(unsigned int mask)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int bit = 0;
+
+    for (; (mask & 1) == 0; mask >>= 1)
+    {
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+static int highest_bit(unsigned int mask)
+{
+#if defined(__GNUC__)
+    return (int)(8 * sizeof(mask)) - 1 - __builtin_clz(mask);
+#else
+    int bit = -1;
+
+    for (; mask != 0; mask >>= 1)
+    {
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+// Checks the candidates in mask, one bit per position from at on, for the
+// middle of the pattern: first to last, or backwards last to first.
+static size_t search_verify(const unsigned char* text, size_t at,
+        unsigned int mask, const unsigned char* pattern, size_t length,
+        enum buffer_search_direction d, size_t none)
+{
+    while (mask != 0)
+    {
+        int bit = d == BUFFER_FORWARD ? lowest_bit(mask) : highest_bit(mask);
+
+        if (memcmp(&text[at + bit + 1], &pattern[1], length - 2) == 0)
+        {
+            return at + bit;
+        }
+        mask &= ~(1U << bit);
+    }
+    return none;
+}
+
+// The SIMD kernels check whole vectors of the count start positions, and
+// tell in *covered how many. They return a match, or count.
+static size_t search_sse2(const unsigned char* text, size_t count,
+        const unsigned char* pattern, size_t length,
+        enum buffer_search_direction d, size_t* covered)
+{
+    __m128i first = _mm_set1_epi8((char)pattern[0]);
+    __m128i last = _mm_set1_epi8((char)pattern[length - 1]);
+    size_t i;
+    size_t s;
+
+    *covered = count - count % 16;
+    for (i = 0; i < *covered; i += 16)
+    {
+        s = d == BUFFER_FORWARD ? i : count - 16 - i;
+        s = search_verify(text, s, (unsigned int)_mm_movemask_epi8(
+                _mm_and_si128(
+                    _mm_cmpeq_epi8(first, _mm_loadu_si128(
+                        (const __m128i*)&text[s])),
+                    _mm_cmpeq_epi8(last, _mm_loadu_si128(
+                        (const __m128i*)&text[s + length - 1])))),
+            pattern, length, d, count);
+        if (s != count)
+        {
+            return s;
+        }
+    }
+    return count;
+}
+
+#if defined(HAVE_AVX2)
+__attribute__((target("avx2")))
+static size_t search_avx2(const unsigned char* text, size_t count,
+        const unsigned char* pattern, size_t length,
+        enum buffer_search_direction d, size_t* covered)
+{
+    __m256i first = _mm256_set1_epi8((char)pattern[0]);
+    __m256i last = _mm256_set1_epi8((char)pattern[length - 1]);
+    size_t i;
+    size_t s;
+
+    *covered = count - count % 32;
+    for (i = 0; i < *covered; i += 32)
+    {
+        s = d == BUFFER_FORWARD ? i : count - 32 - i;
+        s = search_verify(text, s, (unsigned int)_mm256_movemask_epi8(
+                _mm256_and_si256(
+                    _mm256_cmpeq_epi8(first, _mm256_loadu_si256(
+                        (const __m256i*)&text[s])),
+                    _mm256_cmpeq_epi8(last, _mm256_loadu_si256(
+                        (const __m256i*)&text[s + length - 1])))),
+            pattern, length, d, count);
+        if (s != count)
+        {
+            return s;
+        }
+    }
+    return count;
+}
+
+static int cpu_has_avx2(void)
+{
+    static int has = -1;
+
+    if (has < 0)
+    {
+        __builtin_cpu_init();
+        has = __builtin_cpu_supports("avx2") != 0;
+    }
+    return has;
+}
+#endif
+#endif
+
+// Finds the first, or backwards the last, match within size bytes of text,
+// or returns size. Short patterns are filtered on their first and last
+// byte with SIMD.
+static size_t search_block(const unsigned char* text, size_t size,
+        const unsigned char* pattern, size_t length, const size_t* shift,
+        enum buffer_search_direction d)
+{
+#if defined(HAVE_SSE2)
+    if (length >= 2 && length <= SEARCH_SIMD_LENGTH && size >= length)
+    {
+        size_t count = size - length + 1;
+        size_t covered;
+        size_t s;
+
+#if defined(HAVE_AVX2)
+        if (cpu_has_avx2())
+        {
+            s = search_avx2(text, count, pattern, length, d, &covered);
+        }
+        else
+#endif
+        {
+            s = search_sse2(text, count, pattern, length, d, &covered);
+        }
+        if (s != count)
+        {
+            return s;
+        }
+        if (d == BUFFER_FORWARD)
+        {
+            s = search_scalar(&text[covered], size - covered, pattern,
+                              length, shift, d);
+            return s != size - covered ? covered + s : size;
+        }
+        s = search_scalar(text, size - covered, pattern, length, shift, d);
+        return s != size - covered ? s : size;
+    }
+#endif
+    return search_scalar(text, size, pattern, length, shift, d);
+}
+
+// A pattern, with wildcards where bits are clear in mask (if any). Masked
+// patterns are found by their longest run without wildcards, the anchor.
+struct search
+{
+    const unsigned char* pattern;
+    const unsigned char* mask;
+    size_t length;
+    size_t anchor;          // Where the anchor is in the pattern,
+    size_t anchor_length;   // and how long: 0 where each byte has wildcards,
+    size_t probe;           // and the byte with the most bits is looked for.
+    size_t shift[256];      // Horspool's, for the anchor.
+    enum buffer_search_direction d;
+};
+
+static void search_prepare(struct search* s, const unsigned char* pattern,
+        const unsigned char* mask, size_t length,
+        enum buffer_search_direction d)
+{
+    size_t run = 0;
+    int most = -1;
+    int bits;
+    unsigned int set;
+    size_t i;
+
+    s->pattern = pattern;
+    s->length = length;
+    s->anchor = 0;
+    s->anchor_length = 0;
+    s->probe = 0;
+    s->d = d;
+    for (i = 0; i < length; i++)
+    {
+        run = mask == NULL || mask[i] == 0xFF ? run + 1 : 0;
+        if (run > s->anchor_length)
+        {
+            s->anchor = i + 1 - run;
+            s->anchor_length = run;
+        }
+        // The number of bits set in its mask:
+        bits = 0;
+        for (set = mask != NULL ? mask[i] : 0; set != 0; set &= set - 1)
+        {
+            bits++;
+        }
+        if (bits > most)
+        {
+            s->probe = i;
+            most = bits;
+        }
+    }
+    s->mask = s->anchor_length < length ? mask : NULL;
+    if (s->anchor_length > 0)
+    {
+        search_shifts(&pattern[s->anchor], s->anchor_length, d, s->shift);
+    }
+}
+
+// Tells whether the pattern is at text, as far as the mask goes.
+static int search_equal(const unsigned char* text, const struct search* s)
+{
+    size_t i = 0;
+
+#if defined(HAVE_SSE2)
+    for (; i + 16 <= s->length; i += 16)
+    {
+        __m128i mask = _mm_loadu_si128((const __m128i*)&s->mask[i]);
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(
+                _mm_and_si128(mask, _mm_loadu_si128(
+                    (const __m128i*)&text[i])),
+                _mm_and_si128(mask, _mm_loadu_si128(
+                    (const __m128i*)&s->pattern[i])))) != 0xFFFF)
+        {
+            return 0;
+        }
+    }
+#endif
+    for (; i < s->length; i++)
+    {
+        if (((text[i] ^ s->pattern[i]) & s->mask[i]) != 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Finds the next place from low up, or backwards from high down, where the
+// probe byte is. Returns high where there is none.
+static size_t search_probe(const unsigned char* text, size_t low,
+        size_t high, const struct search* s)
+{
+    const unsigned char* t = &text[s->probe];
+    unsigned char mask = s->mask[s->probe];
+    unsigned char value = s->pattern[s->probe] & mask;
+    size_t none = high;
+    size_t i;
+#if defined(HAVE_SSE2)
+    __m128i vmask = _mm_set1_epi8((char)mask);
+    __m128i vvalue = _mm_set1_epi8((char)value);
+    unsigned int bits;
+
+    while (high - low >= 16)
+    {
+        i = s->d == BUFFER_FORWARD ? low : high - 16;
+        bits = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(vvalue,
+            _mm_and_si128(vmask, _mm_loadu_si128((const __m128i*)&t[i]))));
+        if (bits != 0)
+        {
+            return i + (s->d == BUFFER_FORWARD ? lowest_bit(bits)
+                                               : highest_bit(bits));
+        }
+        if (s->d == BUFFER_FORWARD)
+        {
+            low += 16;
+        }
+        else
+        {
+            high -= 16;
+        }
+    }
+#endif
+    for (i = 0; i < high - low; i++)
+    {
+        size_t at = s->d == BUFFER_FORWARD ? low + i : high - 1 - i;
+
+        if ((t[at] & mask) == value)
+        {
+            return at;
+        }
+    }
+    return none;
+}
+
+// Like search_block(), for any pattern.
+static size_t search_text(const unsigned char* text, size_t size,
+        const struct search* s)
+{
+    const unsigned char* anchor = &s->pattern[s->anchor];
+    size_t r = s->anchor_length;
+    size_t count;       // Places where the pattern can start.
+    size_t low = 0;     // Those from low to high are left to look at.
+    size_t high;
+    size_t i;
+
+    if (s->mask == NULL)
+    {
+        return search_block(text, size, s->pattern, s->length, s->shift,
+                            s->d);
+    }
+    if (size < s->length)
+    {
+        return size;
+    }
+    count = size - s->length + 1;
+    for (high = count; low < high;)
+    {
+        if (r == 0)
+        {
+            if ((i = search_probe(text, low, high, s)) == high)
+            {
+                break;
+            }
+        }
+        else
+        {
+            // The next place where the anchor is:
+            i = search_block(&text[low + s->anchor], high - low + r - 1,
+                             anchor, r, s->shift, s->d);
+            if (i == high - low + r - 1)
+            {
+                break;
+            }
+            i += low;
+        }
+        if (search_equal(&text[i], s))
+        {
+            return i;
+        }
+        if (s->d == BUFFER_FORWARD)
+        {
+            low = i + 1;
+        }
+        else
+        {
+            high = i;
+        }
+    }
+    return size;
+}
+
+#if defined(HAVE_PTHREAD) && defined(HAVE_PREAD)
+#define HAVE_SEARCH_THREADS 1
+
+// Searches over more than this many bytes are shared out among b->threads
+// threads, each taking on chunks of SEARCH_CHUNK_SIZE bytes in turn.
+#define SEARCH_THREADS_SIZE (64UL*1024*1024)
+#define SEARCH_CHUNK_SIZE BUFFER_MOVE_SIZE
+#define SEARCH_THREADS_MAX 64
+
+// Like buffer_read(), but straight from the file and the add buffer, so
+// that threads can share it. *stored tells whether any byte is stored.
+static int buffer_gather(struct buffer* b, offset_t offset, size_t size,
+        unsigned char* data, int* stored)
+{
+    size_t i = buffer_piece(b, offset);
+
+    *stored = 0;
+    while (size > 0)
+    {
+        struct piece* p = &b->pieces[i];
+        offset_t source = p->source + (offset - p->offset);
+        size_t n = (size_t)min(p->offset + p->length - offset, size);
+        offset_t end;
+        int hole;
+
+        switch (p->kind)
+        {
+            case PIECE_ADD:
+                memcpy(data, &b->add[source], n);
+                *stored = 1;
+                break;
+
+            case PIECE_ZERO:
+                memset(data, 0, n);
+                break;
+
+            default:
+                io_extent(b->io, source, b->filesize, &hole, &end);
+                if (end > source)
+                {
+                    n = (size_t)min(end - source, n);
+                }
+                if (hole)
+                {
+                    memset(data, 0, n);
+                }
+                else if (!io_read(b->io, source, data, n))
+                {
+                    return 0;
+                }
+                else
+                {
+                    *stored = 1;
+                }
+                break;
+        }
+        data += n;
+        offset += n;
+        size -= n;
+        if (offset == p->offset + p->length)
+        {
+            i++;
+        }
+    }
+    return 1;
+}
+
+#if defined(HAVE_MMAP)
+// Returns where size bytes at offset are mapped, if they lie in one piece
+// of the file; NULL otherwise. *stored as in buffer_gather().
+static const unsigned char* buffer_mapped(struct buffer* b, offset_t offset,
+        size_t size, int* stored)
+{
+    struct piece* p = &b->pieces[buffer_piece(b, offset)];
+    offset_t source = p->source + (offset - p->offset);
+    offset_t end;
+    int hole;
+
+    if (b->map == NULL
+        || p->kind != PIECE_FILE
+        || offset + size > p->offset + p->length
+        || source < b->map_offset
+        || source + size > b->map_offset + b->map_size)
+    {
+        return NULL;
+    }
+    io_extent(b->io, source, b->filesize, &hole, &end);
+    *stored = !hole || end < source + size;
+    return &b->map[source - b->map_offset];
+}
+#endif
+
+// A search shared among threads. Chunk k holds the matches that start
+// SEARCH_CHUNK_SIZE * k bytes past low, or backwards, before high.
+struct search_job
+{
+    struct buffer* b;
+    const struct search* s;
+    int skip_holes;
+    offset_t low;
+    offset_t high;
+    pthread_mutex_t lock;
+    offset_t next;          // The next chunk to take on.
+    offset_t end;           // Chunks from here on are not needed.
+    int found;              // Chunk end has a match, at match.
+    offset_t match;
+};
+
+static void* search_worker(void* arg)
+{
+    struct search_job* job = arg;
+    size_t m = job->s->length;
+    unsigned char* data = io_alloc(job->b->io, SEARCH_CHUNK_SIZE + m - 1);
+    const unsigned char* text;
+    offset_t k;
+    offset_t start;
+    offset_t end;
+    size_t size;
+    size_t i;
+    int stored;
+    int ok;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&job->lock);
+        k = job->next;
+        if (k < job->end)
+        {
+            job->next++;
+        }
+        ok = k < job->end;
+        pthread_mutex_unlock(&job->lock);
+        if (!ok)
+        {
+            break;
+        }
+        // Matches start from start to end in this chunk:
+        if (job->s->d == BUFFER_FORWARD)
+        {
+            start = job->low + k * SEARCH_CHUNK_SIZE;
+            end = min(job->high, start + (SEARCH_CHUNK_SIZE - 1));
+        }
+        else
+        {
+            end = job->high - k * SEARCH_CHUNK_SIZE;
+            start = max(job->low, end - min(end, SEARCH_CHUNK_SIZE - 1));
+        }
+        size = (size_t)(end - start) + m;
+        // The mapping is searched in place where it can be:
+        text = NULL;
+#if defined(HAVE_MMAP)
+        text = buffer_mapped(job->b, start, size, &stored);
+#endif
+        ok = text != NULL
+            || (data != NULL
+                && buffer_gather(job->b, start, size, data, &stored));
+        if (text == NULL)
+        {
+            text = data;
+        }
+        i = size;
+        if (ok && (stored || !job->skip_holes))
+        {
+            i = search_text(text, size, job->s);
+        }
+        if (!ok || i != size)
+        {
+            pthread_mutex_lock(&job->lock);
+            if (k < job->end)
+            {
+                job->end = k;
+                job->found = ok;
+                job->match = start + i;
+            }
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    free(data);
+    return NULL;
+}
+
+// Finds the first, or going backwards the last, match that starts from low
+// to high, with the calling thread and b->threads - 1 more.
+static int buffer_search_threads(struct buffer* b, offset_t low,
+        offset_t high, const struct search* s, int skip_holes,
+        offset_t* match_offset)
+{
+    pthread_t threads[SEARCH_THREADS_MAX - 1];
+    struct search_job job;
+    int count;
+    int i;
+
+    // Pages written to but not to the file yet would be missed:
+    if (!buffer_file_flush(b) || pthread_mutex_init(&job.lock, NULL) != 0)
+    {
+        return 0;
+    }
+    job.b = b;
+    job.s = s;
+    job.skip_holes = skip_holes;
+    job.low = low;
+    job.high = high;
+    job.next = 0;
+    job.end = (high - low) / SEARCH_CHUNK_SIZE + 1;
+    job.found = 0;
+    job.match = 0;
+    for (count = 0; count < min(b->threads, SEARCH_THREADS_MAX) - 1; count++)
+    {
+        if (pthread_create(&threads[count], NULL, search_worker, &job) != 0)
+        {
+            break;
+        }
+    }
+    search_worker(&job);
+    for (i = 0; i < count; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&job.lock);
+    if (job.found)
+    {
+        *match_offset = job.match;
+    }
+    return job.found;
+}
+#endif
+
+// Finds the pattern from offset on, or backwards from offset down. Bits
+// clear in search_mask, which may be NULL, match anything.
+int buffer_search(struct buffer* b, offset_t offset, size_t search_length,
+        const unsigned char* search_target, const unsigned char* search_mask,
+        enum buffer_search_direction d, offset_t* match_offset)
+{
+    struct scan scan;
+    struct search s;
+    unsigned char* seam;
+    unsigned char* data;
+    size_t m = search_length;
+    size_t size;
+    size_t i;
+    offset_t start;
+    offset_t end;
+    offset_t low;
+    offset_t high;
+    int found = 0;
+    // A pattern with anything but zeros cannot match inside a hole:
+    int skip_holes = 0;
+
+    if (m == 0
+        || m > b->length
+        || (d == BUFFER_FORWARD && offset > b->length - m))
+    {
+        return 0;
+    }
+    for (i = 0; i < m; i++)
+    {
+        skip_holes |= (search_target[i]
+                       & (search_mask != NULL ? search_mask[i] : 0xFF)) != 0;
+    }
+    search_prepare(&s, search_target, search_mask, m, d);
+#if defined(HAVE_SEARCH_THREADS)
+    low = d == BUFFER_FORWARD ? offset : 0;
+    high = d == BUFFER_FORWARD ? b->length - m : min(offset, b->length - m);
+    if (b->threads > 1 && high - low >= SEARCH_THREADS_SIZE)
+    {
+        return buffer_search_threads(b, low, high, &s, skip_holes,
+                                     match_offset);
+    }
+#endif
+    if ((seam = malloc(2 * m)) == NULL)
+    {
+        return 0;
+    }
+    scan.data = b->backend == BUFFER_READ
+        ? io_alloc(b->io, BUFFER_MOVE_SIZE)
+        : NULL;
+    scan.offset = 0;
+    scan.length = 0;
+    buffer_scan_begin(b);
+    if (d == BUFFER_FORWARD)
+    {
+        // Matches start at start or later in the run from there to end:
+        for (start = offset; !found && start <= b->length - m; start = end)
+        {
+            if (!skip_holes || !buffer_hole(b, start, &end))
+            {
+                if ((data = buffer_block(b, &scan, start, 0, &size)) == NULL)
+                {
+                    break;
+                }
+                end = start + size;
+                if ((i = search_text(data, size, &s)) != size)
+                {
+                    *match_offset = start + i;
+                    found = 1;
+                    break;
+                }
+            }
+            // Those that start in the run and end past it:
+            low = end - start >= m ? end - m + 1 : start;
+            high = min(end + m - 1, b->length);
+            if (high - low >= m)
+            {
+                if (!buffer_read(b, low, (size_t)(high - low), seam))
+                {
+                    break;
+                }
+                if ((i = search_text(seam, (size_t)(high - low), &s))
+                        != high - low)
+                {
+                    *match_offset = low + i;
+                    found = 1;
+                }
+            }
+        }
+    }
+    else
+    {
+        // Matches end before end in the run from start to there:
+        for (end = min(offset, b->length - m) + m; !found && end >= m;
+             end = start)
+        {
+            if (skip_holes && buffer_hole(b, end - 1, &high))
+            {
+                start = buffer_hole_start(b, end - 1);
+            }
+            else
+            {
+                if ((data = buffer_block(b, &scan, end - 1, 1, &size))
+                        == NULL)
+                {
+                    break;
+                }
+                start = end - size;
+                if ((i = search_text(data, size, &s)) != size)
+                {
+                    *match_offset = start + i;
+                    found = 1;
+                    break;
+                }
+            }
+            // Those that end in the run and start before it:
+            low = start >= m - 1 ? start - (m - 1) : 0;
+            high = min(start + m - 1, end);
+            if (high - low >= m)
+            {
+                if (!buffer_read(b, low, (size_t)(high - low), seam))
+                {
+                    break;
+                }
+                if ((i = search_text(seam, (size_t)(high - low), &s))
+                        != high - low)
+                {
+                    *match_offset = low + i;
+                    found = 1;
+                }
+            }
+        }
+    }
+    buffer_scan_end(b);
+    free(scan.data);
+    free(seam);
+    return found;
+}
+
+// Writes over size bytes at offset, and past the end appends. Writes
+// count as typing, see buffer_seal().
+int buffer_write(struct buffer* b, offset_t offset, size_t size,
+        unsigned char* data)
+{
+    struct piece p;
+
+    if (b->io->readonly || !buffer_append(b, data, size, &p.source))
+    {
+        return 0;
+    }
+    p.length = size;
+    p.kind = PIECE_ADD;
+    if (size == 0)
+    {
+        return 1;
+    }
+    if (!buffer_edit(b, offset, size, &p, 1, 1))
+    {
+        b->add_length = (size_t)p.source;
+        return 0;
+    }
+    buffer_journal_record(b, JOURNAL_WRITE, offset, size, data);
+    return 1;
+}
+
+// Inserts size bytes at offset, as typing.
+int buffer_insert_data(struct buffer* b, offset_t offset, size_t size,
+        unsigned char* data)
+{
+    struct piece p;
+
+    if (b->io->readonly || !buffer_append(b, data, size, &p.source))
+    {
+        return 0;
+    }
+    p.length = size;
+    p.kind = PIECE_ADD;
+    if (size == 0)
+    {
+        return 1;
+    }
+    if (!buffer_edit(b, offset, 0, &p, 1, 1))
+    {
+        b->add_length = (size_t)p.source;
+        return 0;
+    }
+    buffer_journal_record(b, JOURNAL_INSERT_DATA, offset, size, data);
+    return 1;
+}
+
+int buffer_insert(struct buffer* b, offset_t offset, offset_t size)
+{
+    struct piece p;
+
+    p.length = min(size, ~(offset_t)0 - b->length);
+    p.source = 0;
+    p.kind = PIECE_ZERO;
+    if (p.length == 0 || !buffer_edit(b, offset, 0, &p, 1, 0))
+    {
+        return p.length == 0;
+    }
+    buffer_journal_record(b, JOURNAL_INSERT, offset, p.length, NULL);
+    return 1;
+}
+
+int buffer_remove(struct buffer* b, offset_t offset, offset_t size)
+{
+    if (!buffer_edit(b, offset, size, NULL, 0, 0))
+    {
+        return 0;
+    }
+    buffer_journal_record(b, JOURNAL_REMOVE, offset, size, NULL);
+    return 1;
+}
+
+// Overwrites size bytes at offset with a pattern repeated, as one change.
+int buffer_fill(struct buffer* b, offset_t offset, offset_t size,
+        const unsigned char* pattern, size_t pattern_size)
+{
+    struct piece zeros;
+    struct piece* pieces = &zeros;
+    unsigned char* tile;
+    offset_t source;
+    size_t tile_size;
+    size_t count;
+    size_t filled;
+    size_t i;
+    int result;
+
+    if (b->io->readonly || pattern_size == 0)
+    {
+        return 0;
+    }
+    offset = min(offset, b->length);
+    size = min(size, b->length - offset);
+    if (size == 0)
+    {
+        return 1;
+    }
+    for (i = 0; i < pattern_size && pattern[i] == 0; i++)
+    {
+    }
+    if (i == pattern_size)
+    {
+        zeros.length = size;
+        zeros.source = 0;
+        zeros.kind = PIECE_ZERO;
+        count = 1;
+    }
+    else
+    {
+        tile_size = (size_t)min(size, max(BUFFER_FILL_SIZE / pattern_size, 1)
+                                          * pattern_size);
+        count = (size_t)((size + tile_size - 1) / tile_size);
+        if (count != (size + tile_size - 1) / tile_size
+            || (tile = buffer_add_room(b, tile_size)) == NULL
+            || (pieces = calloc(count, sizeof(*pieces))) == NULL)
+        {
+            return 0;
+        }
+        memcpy(tile, pattern, min(pattern_size, tile_size));
+        for (filled = pattern_size; filled < tile_size; filled *= 2)
+        {
+            memcpy(&tile[filled], tile, min(filled, tile_size - filled));
+        }
+        source = b->add_length;
+        b->add_length += tile_size;
+        for (i = 0; i < count; i++)
+        {
+            pieces[i].length = min(size - (offset_t)i * tile_size, tile_size);
+            pieces[i].source = source;
+            pieces[i].kind = PIECE_ADD;
+        }
+    }
+    result = buffer_edit(b, offset, size, pieces, count, 0);
+    if (pieces != &zeros)
+    {
+        free(pieces);
+    }
+    if (result && b->journal_data != NULL)
+    {
+        unsigned char* data = malloc(8 + pattern_size);
+
+        if (data == NULL)
+        {
+            buffer_journal_close(b);
+            return 1;
+        }
+        journal_put(data, size);
+        memcpy(&data[8], pattern, pattern_size);
+        buffer_journal_record(b, JOURNAL_FILL, offset, 8 + pattern_size,
+                              data);
+        free(data);
+    }
+    return result;
+}
+
+// Puts size bytes at offset on the clipboard. Only their pieces are taken,
+// so that copying takes no time whatever the size.
+int buffer_copy(struct buffer* b, offset_t offset, offset_t size)
+{
+    struct change c;
+
+    offset = min(offset, b->length);
+    size = min(size, b->length - offset);
+    c.offset = 0;
+    c.length = size;
+    c.pieces = NULL;
+    c.piece_count = 0;
+    // The clipboard's pieces are not part of the history:
+    if (!buffer_capture(b, offset, size, &c))
+    {
+        b->history_pieces -= c.piece_count;
+        buffer_forget(&c);
+        return 0;
+    }
+    b->history_pieces -= c.piece_count;
+    buffer_forget(&b->clipboard);
+    b->clipboard = c;
+    buffer_journal_record(b, JOURNAL_COPY, offset, size, NULL);
+    return 1;
+}
+
+// Inserts what is on the clipboard at offset.
+int buffer_paste(struct buffer* b, offset_t offset)
+{
+    if (b->clipboard.length == 0
+        || !buffer_edit(b, offset, 0, b->clipboard.pieces,
+                        b->clipboard.piece_count, 0))
+    {
+        return 0;
+    }
+    buffer_journal_record(b, JOURNAL_PASTE, offset, 0, NULL);
+    return 1;
+}
+
+// Appends bytes, or zeros where data is NULL, to the clipboard.
+static int buffer_clipboard_add(struct buffer* b, const unsigned char* data,
+        offset_t size)
+{
+    struct piece* pieces = realloc(b->clipboard.pieces,
+        (b->clipboard.piece_count + 1) * sizeof(*pieces));
+    struct piece* p;
+
+    if (pieces == NULL)
+    {
+        return 0;
+    }
+    b->clipboard.pieces = pieces;
+    p = &pieces[b->clipboard.piece_count];
+    p->offset = b->clipboard.length;
+    p->length = size;
+    p->source = 0;
+    p->kind = data == NULL ? PIECE_ZERO : PIECE_ADD;
+    if (data != NULL
+        && (size != (size_t)size
+            || !buffer_append(b, data, (size_t)size, &p->source)))
+    {
+        return 0;
+    }
+    ++b->clipboard.piece_count;
+    b->clipboard.length += size;
+    return 1;
+}
+
+// Reverts the last change, and tells where it was.
+int buffer_undo(struct buffer* b, offset_t* offset)
+{
+    if (b->undo_count == 0)
+    {
+        return 0;
+    }
+    --b->undo_count;
+    if (!buffer_apply(b, &b->changes[b->undo_count]))
+    {
+        ++b->undo_count;
+        return 0;
+    }
+    *offset = b->changes[b->undo_count].offset;
+    buffer_journal_record(b, JOURNAL_UNDO, 0, 0, NULL);
+    return 1;
+}
+
+// Makes the last change undone again, and tells where it was.
+int buffer_redo(struct buffer* b, offset_t* offset)
+{
+    if (b->undo_count == b->change_count)
+    {
+        return 0;
+    }
+    ++b->undo_count;
+    if (!buffer_apply(b, &b->changes[b->undo_count - 1]))
+    {
+        --b->undo_count;
+        return 0;
+    }
+    *offset = b->changes[b->undo_count - 1].offset;
+    buffer_journal_record(b, JOURNAL_REDO, 0, 0, NULL);
+    return 1;
+}
+
+// Ends the current run of typing, so that what follows is undone apart.
+void buffer_seal(struct buffer* b)
+{
+    // Only seals that end a run of typing change what the history does:
+    if (b->typing)
+    {
+        buffer_journal_record(b, JOURNAL_SEAL, 0, 0, NULL);
+    }
+    b->typing = 0;
+}
+
+// Starts journaling to name. Returns 1 where a journal of the file as it
+// is was left, for buffer_journal_recover(); -1 where another instance has
+// it.
+int buffer_journal_open(struct buffer* b, const char* name)
+{
+    unsigned char header[BUFFER_JOURNAL_HEADER];
+    unsigned char expected[BUFFER_JOURNAL_HEADER];
+    offset_t size;
+
+    if (b->io->readonly)
+    {
+        return 0;
+    }
+    b->journal_name = malloc(strlen(name) + sizeof(BUFFER_JOURNAL_SUFFIX));
+    if (b->journal_name == NULL)
+    {
+        return 0;
+    }
+    strcpy(b->journal_name, name);
+    strcat(b->journal_name, BUFFER_JOURNAL_SUFFIX);
+    if (!io_open(&b->journal, b->journal_name, IO_CREATE))
+    {
+        free(b->journal_name);
+        b->journal_name = NULL;
+        return 0;
+    }
+    if (!io_lock(&b->journal))
+    {
+        io_close(&b->journal);
+        free(b->journal_name);
+        b->journal_name = NULL;
+        return -1;
+    }
+    if (io_size(&b->journal, &size)
+        && size > BUFFER_JOURNAL_HEADER
+        && io_read(&b->journal, 0, header, sizeof(header))
+        && buffer_journal_header(b, expected)
+        && memcmp(header, expected, sizeof(header)) == 0)
+    {
+        return 1;
+    }
+    buffer_journal_reset(b);
+    return 0;
+}
+
+// Replays the journal that buffer_journal_open() found, or drops it, and
+// goes on journaling. Replay stops at the first edit that does not apply.
+void buffer_journal_recover(struct buffer* b, int replay)
+{
+    unsigned char record[BUFFER_JOURNAL_RECORD];
+    unsigned char* data = NULL;
+    offset_t end = BUFFER_JOURNAL_HEADER;
+    offset_t size;
+    offset_t offset;
+    offset_t length;
+    int ok = 1;
+
+    if (b->journal_name == NULL)
+    {
+        return;
+    }
+    if (!replay || !io_size(&b->journal, &size))
+    {
+        buffer_journal_reset(b);
+        return;
+    }
+    while (ok
+           && end + BUFFER_JOURNAL_RECORD <= size
+           && io_read(&b->journal, end, record, sizeof(record)))
+    {
+        offset = journal_get(&record[1]);
+        length = journal_get(&record[9]);
+        if (journal_has_data(record[0]))
+        {
+            ok = length <= size - end - BUFFER_JOURNAL_RECORD
+                && length < (offset_t)(size_t)-1;
+            if (ok)
+            {
+                unsigned char* more = realloc(data, (size_t)length + 1);
+
+                ok = more != NULL
+                    && io_read(&b->journal, end + BUFFER_JOURNAL_RECORD,
+                               more, (size_t)length);
+                data = more != NULL ? more : data;
+            }
+            end += ok ? length : 0;
+        }
+        switch (record[0])
+        {
+            case JOURNAL_WRITE:
+                ok = ok && buffer_write(b, offset, (size_t)length, data);
+                break;
+
+            case JOURNAL_FILL:
+                ok = ok
+                    && length > 8
+                    && buffer_fill(b, offset, journal_get(data), &data[8],
+                                   (size_t)length - 8);
+                break;
+
+            case JOURNAL_COPY:
+                ok = buffer_copy(b, offset, length);
+                break;
+
+            case JOURNAL_PASTE:
+                ok = buffer_paste(b, offset);
+                break;
+
+            case JOURNAL_CLIP:
+                ok = ok && buffer_clipboard_add(b, data, length);
+                break;
+
+            case JOURNAL_CLIP_ZERO:
+                ok = buffer_clipboard_add(b, NULL, length);
+                break;
+
+            case JOURNAL_INSERT:
+                ok = buffer_insert(b, offset, length);
+                break;
+
+            case JOURNAL_INSERT_DATA:
+                ok = ok
+                    && buffer_insert_data(b, offset, (size_t)length, data);
+                break;
+
+            case JOURNAL_REMOVE:
+                ok = buffer_remove(b, offset, length);
+                break;
+
+            case JOURNAL_UNDO:
+                ok = buffer_undo(b, &offset);
+                break;
+
+            case JOURNAL_REDO:
+                ok = buffer_redo(b, &offset);
+                break;
+
+            case JOURNAL_SEAL:
+                buffer_seal(b);
+                break;
+
+            default:
+                ok = 0;
+                break;
+        }
+        end += ok ? BUFFER_JOURNAL_RECORD : 0;
+    }
+    free(data);
+    b->journal_data = malloc(BUFFER_JOURNAL_SIZE);
+    b->journal_length = 0;
+    b->journal_end = end;
+    b->journal_unsynced = 0;
+    if (b->journal_data == NULL || !io_resize(&b->journal, end))
+    {
+        buffer_journal_close(b);
+    }
+}
+
+// Notes that a save moved only part of the piece at index i, so that the
+// table still describes the contents.
+static void buffer_save_moved(struct buffer* b, size_t i, offset_t moved,
+        int backwards)
+{
+    struct piece* p = &b->pieces[i];
+
+    if (moved == 0)
+    {
+        return;
+    }
+    if (moved < p->length)
+    {
+        if (!buffer_reserve(b, b->piece_count + 1))
+        {
+            return;
+        }
+        i = buffer_split(b, backwards ? p->offset + p->length - moved
+                                      : p->offset + moved);
+        i -= !backwards;
+    }
+    b->pieces[i].source = b->pieces[i].offset;
+}
+
+// Where a hole of size bytes pushed the file from `from` on aside, points
+// the file pieces before index i there. Room for one split is reserved.
+static void buffer_save_unshifted(struct buffer* b, size_t i, offset_t from,
+        offset_t size)
+{
+    struct piece* p;
+
+    while (i-- > 0)
+    {
+        p = &b->pieces[i];
+        if (p->kind != PIECE_FILE)
+        {
+            continue;
+        }
+        if (p->source + p->length <= from)
+        {
+            break;
+        }
+        if (p->source < from)
+        {
+            i = buffer_split(b, p->offset + (from - p->source));
+            p = &b->pieces[i];
+        }
+        p->source += size;
+    }
+}
+
+// Has the file system shift the pieces that move by whole blocks. What is
+// left over is up to buffer_save().
+static int buffer_save_shift(struct buffer* b)
+{
+    offset_t block = io_block_size(b->io);
+    offset_t shift = 0; // How far the bytes still ahead moved, modulo 2^64.
+    offset_t end = 0;   // Where the previous file piece's bytes end now.
+    offset_t at = 0;    // Where the last shift was, and by how much.
+    offset_t size = 0;
+    offset_t moved;
+    size_t failed;
+    size_t i;
+
+    // Without room to split a piece, should putting bytes back fail, the
+    // pieces are only copied:
+    if (block == 0 || b->io->readonly
+        || !buffer_reserve(b, b->piece_count + 1))
+    {
+        return 1;
+    }
+    for (i = 0; i < b->piece_count; i++)
+    {
+        struct piece* p = &b->pieces[i];
+
+        if (p->kind != PIECE_FILE)
+        {
+            continue;
+        }
+        p->source += shift;
+        if (p->offset > p->source && (p->offset - p->source) % block == 0)
+        {
+            size = p->offset - p->source;
+            at = p->source - p->source % block;
+            if (buffer_file_shift(b, at, size, 0))
+            {
+                p->source += size;
+                shift += size;
+                // Put back what the hole pushed aside of the pieces before:
+                if (end > at
+                    && !buffer_file_move(b, at + size, at, end - at, &moved))
+                {
+                    break;
+                }
+            }
+        }
+        else if (p->offset < p->source
+                 && (p->source - p->offset) % block == 0
+                 && p->offset >= end)
+        {
+            size = p->source - p->offset;
+            at = (end + block - 1) / block * block;
+            // Collapsing must leave some of the file behind the range.
+            if (at + size < b->filesize)
+            {
+                // Save what the collapse would drop of this piece in front of
+                // the range, where it ends up anyway:
+                if (at + size > p->source
+                    && !buffer_file_move(b, p->source, p->offset,
+                                         at + size - p->source, &moved))
+                {
+                    break;
+                }
+                if (buffer_file_shift(b, at, size, 1))
+                {
+                    p->source -= size;
+                    shift -= size;
+                }
+            }
+        }
+        end = p->source + p->length;
+    }
+    if (i == b->piece_count)
+    {
+        return 1;
+    }
+    // The pieces not got to yet moved all the same, and the table must
+    // follow what was moved of those around where it failed:
+    for (failed = i++; i < b->piece_count; i++)
+    {
+        if (b->pieces[i].kind == PIECE_FILE)
+        {
+            b->pieces[i].source += shift;
+        }
+    }
+    if (b->pieces[failed].offset < b->pieces[failed].source)
+    {
+        buffer_save_moved(b, failed, moved, 0);
+    }
+    else
+    {
+        buffer_save_unshifted(b, failed, at + moved, size);
+    }
+    return 0;
+}
+
+// Copies size bytes of the file to another one. Holes are skipped, the
+// other file must read as zeros there already.
+static int buffer_file_copy(struct buffer* b, offset_t from, struct io* to_io,
+        offset_t to, offset_t size)
+{
+    unsigned char* data = NULL;
+    offset_t done;
+    offset_t chunk;
+    offset_t hole_end;
+    int copy = 1;
+    int result = 0;
+
+    for (done = 0; done < size; done += chunk)
+    {
+        chunk = min(size - done, BUFFER_MOVE_SIZE);
+        if (buffer_file_hole(b, from + done, &hole_end))
+        {
+            chunk = min(hole_end - (from + done), size - done);
+        }
+        else
+        {
+            chunk = min(chunk, hole_end - (from + done));
+            if (!copy || !io_copy(b->io, from + done, to_io, to + done, chunk))
+            {
+                copy = 0;
+                if ((data == NULL
+                     && (data = io_alloc(b->io, BUFFER_MOVE_SIZE)) == NULL)
+                    || !io_read(b->io, from + done, data, (size_t)chunk)
+                    || !io_write(to_io, to + done, data, (size_t)chunk))
+                {
+                    goto done;
+                }
+            }
+        }
+        if (!buffer_progress(b, chunk))
+        {
+            goto done;
+        }
+    }
+    result = 1;
+done:
+    free(data);
+    return result;
+}
+
+// Saves into a new file that replaces the file. Returns -1 where it cannot
+// be replaced, see io_create_temp().
+static int buffer_save_copy(struct buffer* b)
+{
+    struct io temp = IO_CLOSED;
+    size_t i;
+
+    if (!io_create_temp(b->io, &temp))
+    {
+        return -1;
+    }
+    for (i = 0; i < b->piece_count; i++)
+    {
+        if (b->pieces[i].kind == PIECE_FILE)
+        {
+            b->progress_total += b->pieces[i].length;
+        }
+    }
+    // Zeros are left to the holes this leaves:
+    if (!io_resize(&temp, b->length))
+    {
+        goto error;
+    }
+    for (i = 0; i < b->piece_count; i++)
+    {
+        struct piece* p = &b->pieces[i];
+        if (p->kind == PIECE_FILE
+            && !buffer_file_copy(b, p->source, &temp, p->offset, p->length))
+        {
+            goto error;
+        }
+        if (p->kind == PIECE_ADD
+            && !io_write(&temp, p->offset, &b->add[p->source],
+                         (size_t)p->length))
+        {
+            goto error;
+        }
+    }
+#if defined(HAVE_ASYNC)
+    // Fills from the old file land in pages dropped below:
+    while (b->async.pending > 0)
+    {
+        async_wait(&b->async);
+        buffer_poll(b);
+    }
+#endif
+    if (!io_replace(b->io, &temp))
+    {
+        goto error;
+    }
+#if defined(HAVE_MMAP)
+    buffer_unmap(b);
+#endif
+    buffer_invalidate(b);
+    b->filesize = b->length;
+    b->extent_valid = 0;
+    buffer_unedited(b);
+    return 1;
+error:
+    io_discard(&temp);
+    return 0;
+}
+
+// Holds the bytes of the clipboard across a save, which starts the add
+// buffer afresh. Without the memory for that it is emptied.
+static unsigned char* buffer_clipboard_hold(struct buffer* b)
+{
+    unsigned char* data = NULL;
+    offset_t size = 0;
+    size_t i;
+
+    for (i = 0; i < b->clipboard.piece_count; i++)
+    {
+        if (b->clipboard.pieces[i].kind != PIECE_ZERO)
+        {
+            size += b->clipboard.pieces[i].length;
+        }
+    }
+    if (size == 0)
+    {
+        return NULL;
+    }
+    if (size == (size_t)size && buffer_file_flush(b))
+    {
+        data = malloc((size_t)size);
+    }
+    for (i = 0, size = 0; data != NULL && i < b->clipboard.piece_count; i++)
+    {
+        struct piece* p = &b->clipboard.pieces[i];
+        if (p->kind == PIECE_FILE
+            && !io_read(b->io, p->source, &data[size], (size_t)p->length))
+        {
+            free(data);
+            data = NULL;
+            break;
+        }
+        if (p->kind == PIECE_ADD)
+        {
+            memcpy(&data[size], &b->add[p->source], (size_t)p->length);
+        }
+        size += p->kind != PIECE_ZERO ? p->length : 0;
+    }
+    if (data == NULL)
+    {
+        buffer_forget(&b->clipboard);
+        b->clipboard.length = 0;
+    }
+    return data;
+}
+
+static void buffer_clipboard_restore(struct buffer* b, unsigned char* data)
+{
+    offset_t size = 0;
+    offset_t source;
+    size_t i;
+
+    if (data == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < b->clipboard.piece_count; i++)
+    {
+        if (b->clipboard.pieces[i].kind != PIECE_ZERO)
+        {
+            size += b->clipboard.pieces[i].length;
+        }
+    }
+    if (!buffer_append(b, data, (size_t)size, &source))
+    {
+        buffer_forget(&b->clipboard);
+        b->clipboard.length = 0;
+    }
+    for (i = 0; i < b->clipboard.piece_count; i++)
+    {
+        struct piece* p = &b->clipboard.pieces[i];
+        if (p->kind != PIECE_ZERO)
+        {
+            p->kind = PIECE_ADD;
+            p->source = source;
+            source += p->length;
+        }
+    }
+    free(data);
+}
+
+// Reads a piece of the file into the add buffer.
+static int buffer_materialize(struct buffer* b, struct piece* p)
+{
+    unsigned char* room;
+
+    if (p->length != (size_t)p->length
+        || (room = buffer_add_room(b, (size_t)p->length)) == NULL
+        || !io_read(b->io, p->source, room, (size_t)p->length))
+    {
+        return 0;
+    }
+    p->kind = PIECE_ADD;
+    p->source = b->add_length;
+    b->add_length += (size_t)p->length;
+    return 1;
+}
+
+// Finds how many of the count sorted values are at most value.
+static size_t count_at_most(const offset_t* values, size_t count,
+        offset_t value)
+{
+    size_t low = 0;
+    size_t high = count;
+
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (values[middle] <= value)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static int compare_offsets(const void* a, const void* b)
+{
+    offset_t x = *(const offset_t*)a;
+    offset_t y = *(const offset_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Reads the file pieces that are out of the file's order (pastes) into
+// the add buffer, but for the heaviest increasing run of them.
+static int buffer_save_unordered(struct buffer* b)
+{
+    size_t* index;
+    offset_t* ends;
+    offset_t* best;     // Most bytes in order up to each piece, and the
+    size_t* previous;   // piece before it in that run.
+    offset_t* tree;     // Running maxima of best by where pieces end,
+    size_t* tree_piece; // and the piece that holds each.
+    offset_t end = 0;
+    size_t count = 0;
+    size_t last = 0;
+    size_t unordered = 0;
+    size_t i;
+    size_t j;
+    int result = 0;
+
+    for (i = 0; i < b->piece_count; i++)
+    {
+        struct piece* p = &b->pieces[i];
+        if (p->kind == PIECE_FILE)
+        {
+            unordered += p->source < end;
+            end = max(end, p->source + p->length);
+            ++count;
+        }
+    }
+    if (unordered == 0)
+    {
+        return 1;
+    }
+    index = malloc(count * sizeof(*index));
+    ends = malloc(count * sizeof(*ends));
+    best = malloc(count * sizeof(*best));
+    previous = malloc(count * sizeof(*previous));
+    tree = calloc(count + 1, sizeof(*tree));
+    tree_piece = calloc(count + 1, sizeof(*tree_piece));
+    if (index == NULL || ends == NULL || best == NULL || previous == NULL
+        || tree == NULL || tree_piece == NULL || !buffer_file_flush(b))
+    {
+        goto done;
+    }
+    for (i = 0, count = 0; i < b->piece_count; i++)
+    {
+        struct piece* p = &b->pieces[i];
+        if (p->kind == PIECE_FILE)
+        {
+            index[count] = i;
+            ends[count++] = p->source + p->length;
+        }
+    }
+    qsort(ends, count, sizeof(*ends), compare_offsets);
+    for (i = 0; i < count; i++)
+    {
+        struct piece* p = &b->pieces[index[i]];
+
+        // The best run among the pieces before that end before this one:
+        best[i] = 0;
+        previous[i] = count;
+        for (j = count_at_most(ends, count, p->source); j > 0;
+             j -= j & (~j + 1))
+        {
+            if (tree[j] > best[i])
+            {
+                best[i] = tree[j];
+                previous[i] = tree_piece[j];
+            }
+        }
+        best[i] += p->length;
+        if (best[i] > best[last])
+        {
+            last = i;
+        }
+        for (j = count_at_most(ends, count, p->source + p->length - 1) + 1;
+             j <= count; j += j & (~j + 1))
+        {
+            if (best[i] > tree[j])
+            {
+                tree[j] = best[i];
+                tree_piece[j] = i;
+            }
+        }
+    }
+    // Mark the run, then read in the rest:
+    for (i = last; i < count; i = previous[i])
+    {
+        best[i] = 0;
+    }
+    for (i = 0; i < count; i++)
+    {
+        if (best[i] != 0 && !buffer_materialize(b, &b->pieces[index[i]]))
+        {
+            goto done;
+        }
+    }
+    result = 1;
+done:
+    free(index);
+    free(ends);
+    free(best);
+    free(previous);
+    free(tree);
+    free(tree_piece);
+    return result;
+}
+
+// Writes the edits to the file: into a new file that replaces it unless
+// asked to save in place (buffer_save_copy()). When this fails the contents
+// stay what they were, and saving again goes on from there.
+int buffer_save(struct buffer* b)
+{
+    unsigned char* clipboard;
+    offset_t filesize;
+    offset_t moved;
+    size_t i;
+    int result = 0;
+
+    if (!b->modified)
+    {
+        return 1;
+    }
+    b->progress_done = 0;
+    b->progress_total = 0;
+    b->damaged = 0;
+    clipboard = buffer_clipboard_hold(b);
+    if (!b->in_place && (result = buffer_save_copy(b)) != -1)
+    {
+        b->progress_total = 0;
+        buffer_clipboard_restore(b, clipboard);
+        if (result)
+        {
+            buffer_journal_reset(b);
+        }
+        return result;
+    }
+    // Nothing is written yet when this fails:
+    if (!buffer_save_unordered(b))
+    {
+        buffer_clipboard_restore(b, clipboard);
+        return 0;
+    }
+    result = 0;
+    if (!buffer_save_shift(b))
+    {
+        goto done;
+    }
+    filesize = b->filesize;
+    if (b->length > b->filesize && !buffer_file_resize(b, b->length))
+    {
+        goto done;
+    }
+    for (i = 0; i < b->piece_count; i++)
+    {
+        struct piece* p = &b->pieces[i];
+        if (p->kind == PIECE_FILE && p->offset != p->source)
+        {
+            b->progress_total += p->length;
+        }
+    }
+    for (i = 0; i < b->piece_count; i++)
+    {
+        struct piece* p = &b->pieces[i];
+        if (p->kind == PIECE_FILE && p->offset < p->source)
+        {
+            if (!buffer_file_move(b, p->source, p->offset, p->length, &moved))
+            {
+                buffer_save_moved(b, i, moved, 0);
+                goto done;
+            }
+            p->source = p->offset;
+        }
+    }
+    for (i = b->piece_count; i-- > 0;)
+    {
+        struct piece* p = &b->pieces[i];
+        if (p->kind == PIECE_FILE && p->offset > p->source)
+        {
+            if (!buffer_file_move(b, p->source, p->offset, p->length, &moved))
+            {
+                buffer_save_moved(b, i, moved, 1);
+                goto done;
+            }
+            p->source = p->offset;
+        }
+    }
+    for (i = 0; i < b->piece_count; i++)
+    {
+        struct piece* p = &b->pieces[i];
+        if (p->kind == PIECE_ADD
+            && !buffer_file_write(b, p->offset, p->length,
+                                  &b->add[p->source]))
+        {
+            goto done;
+        }
+        // Past the old end the file was extended with zeros already:
+        if (p->kind == PIECE_ZERO
+            && p->offset < filesize
+            && !buffer_file_zero(b, p->offset,
+                                 min(p->length, filesize - p->offset)))
+        {
+            goto done;
+        }
+    }
+    if (b->length < b->filesize && !buffer_file_resize(b, b->length))
+    {
+        goto done;
+    }
+    if (!buffer_file_flush(b))
+    {
+        goto done;
+    }
+    buffer_unedited(b);
+    buffer_clipboard_restore(b, clipboard);
+    buffer_journal_reset(b);
+    result = 1;
+done:
+    if (!result)
+    {
+        buffer_file_flush(b);
+        buffer_clear_history(b);
+        b->history_lost = 1;
+        b->damaged = 1;
+        buffer_clipboard_restore(b, clipboard);
+        // The file no longer is what the journal applies to:
+        buffer_journal_close(b);
+    }
+    b->progress_total = 0;
+    return result;
+}
+
+static int is_hex(int c)
+{
+    return ((c >= '0') && (c <= '9'))
+        || ((c >= 'A') && (c <= 'F'))
+        || ((c >= 'a') && (c <= 'f'));
+}
+
+static int is_printable_ascii(int c)
+{
+    return (c >= ' ') && (c <= '~');
+}
+
+static int hex_char_to_nibble(int c)
+{
+    if (is_hex(c))
+    {
+        int nibble = c - '0';
+        if (nibble > 9)
+        {
+            nibble -= 'A' - '9' - 1;
+        }
+        if (nibble > 15)
+        {
+            nibble -= 'a' - 'A';
+        }
+        return nibble;
+    }
+    return 0;
+}
+
+// Regular expressions over raw bytes, for searching. They know
+//     .               any byte
+//     [a-z\x80-\xff]  any of these bytes, [^...] any other
+//     \xHH            the byte in hex, and \n \r \t \0 as in C
+//     \d \w \s        digits, word and space characters; \D \W \S the rest
+//     * + ? {n} {n,} {n,m}    repetition
+//     a|b (...)       alternatives and grouping
+// and \ before anything else takes it as it is. They run as DFAs built
+// lazily from the NFA, and dropped to start over when they get too big.
+#if defined(__DOS__)
+#define REGEX_NODES 1024
+#define REGEX_STATES 32
+#else
+#define REGEX_NODES 16384
+#define REGEX_STATES 2048
+#endif
+#define REGEX_REPEAT_MAX 1000
+#define REGEX_DEPTH 32      // How deep parentheses go.
+
+enum regex_kind
+{
+    REGEX_EMPTY,        // Nothing.
+    REGEX_BYTES,        // One byte of set.
+    REGEX_CONCAT,       // left, then right.
+    REGEX_ALTERNATE,    // left or right.
+    REGEX_REPEAT,       // left, min to max times, max -1 for any.
+    REGEX_SPLIT,        // In the NFA: on to both out and out1.
+    REGEX_MATCH         // In the NFA: the end of a match.
+};
+
+struct regex_tree
+{
+    enum regex_kind kind;
+    int left;
+    int right;
+    int min;
+    int max;
+    unsigned char set[32];  // A bit for each byte.
+};
+
+struct regex_node
+{
+    enum regex_kind kind;
+    int out;
+    int out1;
+    int tree;           // REGEX_BYTES: the tree node with the set.
+};
+
+// How the NFA nodes of a state go: as a set, or by where their match
+// starts, first or last first. Nodes after a match are left out then.
+enum regex_order
+{
+    REGEX_SET,
+    REGEX_EARLIEST,
+    REGEX_LATEST
+};
+
+struct regex_state
+{
+    int next[256];      // The state each byte leads to, -1 until known.
+    size_t first;       // Its NFA nodes are count from first on in the
+    size_t count;       // pool; none where it cannot match.
+    unsigned long hash;
+    int open;           // Matches still start at the next byte.
+    int accept;         // A match ends (or backwards, starts) here.
+    int final;          // No other match can do better from here on.
+};
+
+struct regex_dfa
+{
+    int start;          // The NFA node it starts from,
+    int unanchored;     // and at every byte again, where this is set.
+    enum regex_order order;
+    struct regex_state* states;
+    size_t state_count;
+    size_t state_capacity;
+    int* table;         // REGEX_STATES * 2 slots: a state + 1, or 0.
+    int* pool;
+    size_t pool_length;
+    size_t pool_capacity;
+    unsigned long flushes;
+};
+
+struct regex
+{
+    struct regex_tree* tree;
+    size_t tree_count;
+    size_t tree_capacity;
+    struct regex_node* nodes;
+    size_t node_count;
+    int* list;          // Room for building a state,
+    int* stack;         // finding what nodes lead to,
+    unsigned* mark;     // and which were seen (mark equals generation).
+    unsigned generation;
+    struct regex_dfa forward;   // Finds where the first match ends,
+    struct regex_dfa reverse;   // and from there back where it starts.
+    struct regex_dfa backward;  // Finds a match before a place,
+    struct regex_dfa latest;    // and from there the last one up to it.
+};
+
+struct regex_parser
+{
+    struct regex* re;
+    const unsigned char* at;
+    const unsigned char* end;
+    const char* error;
+};
+
+static int regex_parse_alternation(struct regex_parser* p, int depth);
+
+static int regex_tree_add(struct regex_parser* p, enum regex_kind kind,
+        int left, int right)
+{
+    struct regex_tree* t;
+
+    if (p->re->tree_count == p->re->tree_capacity)
+    {
+        p->error = "The expression is too long.";
+        return -1;
+    }
+    t = &p->re->tree[p->re->tree_count];
+    t->kind = kind;
+    t->left = left;
+    t->right = right;
+    t->min = 0;
+    t->max = 0;
+    memset(t->set, 0, sizeof(t->set));
+    return (int)p->re->tree_count++;
+}
+
+static void regex_set_range(unsigned char* set, int from, int to)
+{
+    for (; from <= to; from++)
+    {
+        set[from / 8] |= 1 << (from % 8);
+    }
+}
+
+// Adds what the escape after a \ stands for to set. Returns the byte, -1
+// where it stands for a class of them, or -2 where it is not valid.
+static int regex_parse_escape(struct regex_parser* p, unsigned char* set)
+{
+    unsigned char class[32];
+    int c;
+    int i;
+
+    if (p->at == p->end)
+    {
+        p->error = "The expression ends in a \\.";
+        return -2;
+    }
+    switch (c = *p->at++)
+    {
+        case 'x':
+            if (p->end - p->at < 2 || !is_hex(p->at[0]) || !is_hex(p->at[1]))
+            {
+                p->error = "\\x in the expression takes two hex digits.";
+                return -2;
+            }
+            c = hex_char_to_nibble(p->at[0]) << 4
+                | hex_char_to_nibble(p->at[1]);
+            p->at += 2;
+            break;
+
+        case 'n':
+            c = '\n';
+            break;
+
+        case 'r':
+            c = '\r';
+            break;
+
+        case 't':
+            c = '\t';
+            break;
+
+        case '0':
+            c = 0;
+            break;
+
+        case 'd':
+        case 'D':
+        case 'w':
+        case 'W':
+        case 's':
+        case 'S':
+            memset(class, 0, sizeof(class));
+            if (tolower(c) != 's')
+            {
+                regex_set_range(class, '0', '9');
+            }
+            if (tolower(c) == 'w')
+            {
+                regex_set_range(class, 'A', 'Z');
+                regex_set_range(class, 'a', 'z');
+                regex_set_range(class, '_', '_');
+            }
+            if (tolower(c) == 's')
+            {
+                regex_set_range(class, '\t', '\r');
+                regex_set_range(class, ' ', ' ');
+            }
+            for (i = 0; i < 32; i++)
+            {
+                set[i] |= isupper(c) ? ~class[i] : class[i];
+            }
+            return -1;
+    }
+    regex_set_range(set, c, c);
+    return c;
+}
+
+// Parses what follows a [ into the set of tree node t.
+static int regex_parse_class(struct regex_parser* p, int t)
+{
+    unsigned char* set = p->re->tree[t].set;
+    const unsigned char* start;
+    int negate = p->at < p->end && *p->at == '^';
+    int from;
+    int to;
+    int i;
+
+    p->at += negate;
+    // A ] right at the start is one of the bytes:
+    for (start = p->at; p->at < p->end && (*p->at != ']' || p->at == start);)
+    {
+        from = *p->at++;
+        if (from == '\\' && (from = regex_parse_escape(p, set)) < 0)
+        {
+            if (from == -2)
+            {
+                return 0;
+            }
+            continue;
+        }
+        regex_set_range(set, from, from);
+        if (p->end - p->at >= 2 && p->at[0] == '-' && p->at[1] != ']')
+        {
+            p->at++;
+            to = *p->at++;
+            if ((to == '\\' && (to = regex_parse_escape(p, set)) < 0)
+                || to < from)
+            {
+                if (to != -2)
+                {
+                    p->error = "The expression has a bad range in [].";
+                }
+                return 0;
+            }
+            regex_set_range(set, from, to);
+        }
+    }
+    if (p->at == p->end)
+    {
+        p->error = "The expression has a [ without a ].";
+        return 0;
+    }
+    p->at++;
+    for (i = 0; negate && i < 32; i++)
+    {
+        set[i] = ~set[i];
+    }
+    return 1;
+}
+
+static int regex_parse_atom(struct regex_parser* p, int depth)
+{
+    unsigned char* set;
+    int c = *p->at++;
+    int t;
+
+    switch (c)
+    {
+        case '(':
+            if ((t = regex_parse_alternation(p, depth + 1)) < 0)
+            {
+                return -1;
+            }
+            if (p->at == p->end)
+            {
+                p->error = "The expression has a ( without a ).";
+                return -1;
+            }
+            p->at++;
+            return t;
+
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+            p->error = "The expression repeats nothing.";
+            return -1;
+    }
+    if ((t = regex_tree_add(p, REGEX_BYTES, -1, -1)) < 0)
+    {
+        return -1;
+    }
+    set = p->re->tree[t].set;
+    switch (c)
+    {
+        case '.':
+            memset(set, 0xFF, 32);
+            break;
+
+        case '[':
+            if (!regex_parse_class(p, t))
+            {
+                return -1;
+            }
+            break;
+
+        case '\\':
+            if (regex_parse_escape(p, set) == -2)
+            {
+                return -1;
+            }
+            break;
+
+        default:
+            regex_set_range(set, c, c);
+            break;
+    }
+    return t;
+}
+
+static int regex_parse_number(struct regex_parser* p, int* n)
+{
+    if (p->at == p->end || !isdigit(*p->at))
+    {
+        return 0;
+    }
+    for (*n = 0; p->at < p->end && isdigit(*p->at); p->at++)
+    {
+        if ((*n = *n * 10 + (*p->at - '0')) > REGEX_REPEAT_MAX)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Parses {n}, {n,} or {n,m} after the {.
+static int regex_parse_count(struct regex_parser* p, int* min, int* max)
+{
+    if (!regex_parse_number(p, min))
+    {
+        goto error;
+    }
+    *max = *min;
+    if (p->at < p->end && *p->at == ',')
+    {
+        p->at++;
+        *max = -1;
+        if (p->at < p->end
+            && *p->at != '}'
+            && (!regex_parse_number(p, max) || *max < *min))
+        {
+            goto error;
+        }
+    }
+    if (p->at == p->end || *p->at != '}')
+    {
+        goto error;
+    }
+    p->at++;
+    return 1;
+error:
+    p->error = "The expression has a bad count in {}.";
+    return 0;
+}
+
+static int regex_parse_repeat(struct regex_parser* p, int depth)
+{
+    int t = regex_parse_atom(p, depth);
+    int min;
+    int max;
+    int c;
+
+    while (t >= 0
+           && p->at < p->end
+           && ((c = *p->at) == '*' || c == '+' || c == '?' || c == '{'))
+    {
+        p->at++;
+        min = c == '+';
+        max = c == '?' ? 1 : -1;
+        if ((c == '{' && !regex_parse_count(p, &min, &max))
+            || (t = regex_tree_add(p, REGEX_REPEAT, t, -1)) < 0)
+        {
+            return -1;
+        }
+        p->re->tree[t].min = min;
+        p->re->tree[t].max = max;
+    }
+    return t;
+}
+
+static int regex_parse_sequence(struct regex_parser* p, int depth)
+{
+    int t = -1;
+    int next;
+
+    while (p->at < p->end && *p->at != '|' && *p->at != ')')
+    {
+        if ((next = regex_parse_repeat(p, depth)) < 0)
+        {
+            return -1;
+        }
+        t = t < 0 ? next : regex_tree_add(p, REGEX_CONCAT, t, next);
+        if (t < 0)
+        {
+            return -1;
+        }
+    }
+    return t < 0 ? regex_tree_add(p, REGEX_EMPTY, -1, -1) : t;
+}
+
+static int regex_parse_alternation(struct regex_parser* p, int depth)
+{
+    int t;
+    int right;
+
+    if (depth > REGEX_DEPTH)
+    {
+        p->error = "The expression nests too deeply.";
+        return -1;
+    }
+    t = regex_parse_sequence(p, depth);
+    while (t >= 0 && p->at < p->end && *p->at == '|')
+    {
+        p->at++;
+        if ((right = regex_parse_sequence(p, depth)) < 0)
+        {
+            return -1;
+        }
+        t = regex_tree_add(p, REGEX_ALTERNATE, t, right);
+    }
+    return t;
+}
+
+// Tells whether tree node t matches no bytes at all.
+static int regex_nullable(const struct regex* re, int t)
+{
+    const struct regex_tree* n = &re->tree[t];
+
+    switch (n->kind)
+    {
+        case REGEX_BYTES:
+            return 0;
+
+        case REGEX_CONCAT:
+            return regex_nullable(re, n->left)
+                && regex_nullable(re, n->right);
+
+        case REGEX_ALTERNATE:
+            return regex_nullable(re, n->left)
+                || regex_nullable(re, n->right);
+
+        case REGEX_REPEAT:
+            return n->min == 0 || regex_nullable(re, n->left);
+
+        default:
+            return 1;
+    }
+}
+
+static int regex_node_add(struct regex* re, enum regex_kind kind, int out,
+        int out1)
+{
+    struct regex_node* n;
+
+    if (re->node_count == REGEX_NODES)
+    {
+        return -1;
+    }
+    n = &re->nodes[re->node_count];
+    n->kind = kind;
+    n->out = out;
+    n->out1 = out1;
+    n->tree = -1;
+    return (int)re->node_count++;
+}
+
+// Compiles tree node t into NFA nodes that go on to next, mirrored where
+// reverse is set. Returns the first, or -1 where there are too many.
+static int regex_compile_tree(struct regex* re, int t, int next,
+        int reverse)
+{
+    const struct regex_tree* n = &re->tree[t];
+    int end = next;
+    int split;
+    int i;
+
+    if (next < 0)
+    {
+        return -1;
+    }
+    switch (n->kind)
+    {
+        case REGEX_BYTES:
+            if ((next = regex_node_add(re, REGEX_BYTES, next, -1)) >= 0)
+            {
+                re->nodes[next].tree = t;
+            }
+            return next;
+
+        case REGEX_CONCAT:
+            // Backwards the right part comes first:
+            return reverse
+                ? regex_compile_tree(re, n->right,
+                      regex_compile_tree(re, n->left, next, 1), 1)
+                : regex_compile_tree(re, n->left,
+                      regex_compile_tree(re, n->right, next, 0), 0);
 
-#define KEY_ESC 27
-#define KEY_CTRL(x) ((x) > 60 ? (x)-0x60 : (x)-0x40)
+        case REGEX_ALTERNATE:
+            i = regex_compile_tree(re, n->left, next, reverse);
+            split = regex_compile_tree(re, n->right, next, reverse);
+            return i < 0 || split < 0
+                ? -1
+                : regex_node_add(re, REGEX_SPLIT, i, split);
 
-#if defined(__DOS__)
-typedef unsigned long offset_t;
-#else
-typedef size_t offset_t;
-#endif
+        case REGEX_REPEAT:
+            if (n->max < 0)
+            {
+                // A loop back into it, or on:
+                if ((split = regex_node_add(re, REGEX_SPLIT, -1, next)) < 0
+                    || (i = regex_compile_tree(re, n->left, split,
+                                               reverse)) < 0)
+                {
+                    return -1;
+                }
+                re->nodes[split].out = i;
+                next = split;
+            }
+            for (i = n->min; i < n->max && next >= 0; i++)
+            {
+                split = regex_compile_tree(re, n->left, next, reverse);
+                next = split < 0
+                    ? -1
+                    : regex_node_add(re, REGEX_SPLIT, split, end);
+            }
+            for (i = 0; i < n->min && next >= 0; i++)
+            {
+                next = regex_compile_tree(re, n->left, next, reverse);
+            }
+            return next;
 
-enum edit_mode { HEX, ASCII };
+        default:
+            return next;
+    }
+}
 
-struct buffer
+void regex_destroy(struct regex* re)
 {
-    FILE* file;
-    offset_t filesize;
-    offset_t offset;
-    size_t size;
-    int valid;
-    unsigned char* buffer;
-};
+    struct regex_dfa* dfas[4];
+    int i;
 
-void buffer_destroy(struct buffer* b)
-{
-    free(b->buffer);
-    b->file = NULL;
-    b->offset = 0;
-    b->size = 0;
-    b->valid = 0;
-    b->buffer = NULL;
+    dfas[0] = &re->forward;
+    dfas[1] = &re->reverse;
+    dfas[2] = &re->backward;
+    dfas[3] = &re->latest;
+    for (i = 0; i < 4; i++)
+    {
+        free(dfas[i]->states);
+        free(dfas[i]->table);
+        free(dfas[i]->pool);
+        memset(dfas[i], 0, sizeof(*dfas[i]));
+    }
+    free(re->tree);
+    free(re->nodes);
+    free(re->list);
+    free(re->stack);
+    free(re->mark);
+    re->tree = NULL;
+    re->tree_count = 0;
+    re->tree_capacity = 0;
+    re->nodes = NULL;
+    re->node_count = 0;
+    re->list = NULL;
+    re->stack = NULL;
+    re->mark = NULL;
 }
 
-int buffer_create(struct buffer* b, size_t size, FILE* file)
+// Compiles the expression, or tells in *error why it is not valid. Those
+// that match nothing at all are not.
+int regex_compile(struct regex* re, const unsigned char* expression,
+        size_t length, const char** error)
 {
-    b->file = file;
-    if (fseek(file, 0, SEEK_END) != 0)
+    struct regex_parser p;
+    int root;
+    int match;
+
+    memset(re, 0, sizeof(*re));
+    p.re = re;
+    p.at = expression;
+    p.end = expression + length;
+    p.error = NULL;
+    re->tree_capacity = 3 * length + 3;
+    re->tree = malloc(re->tree_capacity * sizeof(*re->tree));
+    re->nodes = malloc(REGEX_NODES * sizeof(*re->nodes));
+    if (re->tree == NULL || re->nodes == NULL)
     {
+        p.error = "Out of memory.";
         goto error;
     }
-    b->filesize = ftell(file);
-    if (fseek(file, 0, SEEK_SET) != 0)
+    if ((root = regex_parse_alternation(&p, 0)) < 0)
     {
         goto error;
     }
-    b->offset = 0;
-    b->buffer = malloc(size);
-    if (b->buffer != NULL)
+    if (p.at < p.end)
     {
-        b->size = size;
-        if (b->filesize == 0
-            || fread(b->buffer, min(b->size, b->filesize), 1, b->file) == 1)
-        {
-            return 1;
-        }
+        p.error = "The expression has a ) without a (.";
+        goto error;
+    }
+    if (regex_nullable(re, root))
+    {
+        p.error = "The expression also matches nothing at all.";
+        goto error;
+    }
+    match = regex_node_add(re, REGEX_MATCH, -1, -1);
+    re->forward.start = regex_compile_tree(re, root, match, 0);
+    re->backward.start = regex_compile_tree(re, root, match, 1);
+    if (re->forward.start < 0 || re->backward.start < 0)
+    {
+        p.error = "The expression is too complex.";
+        goto error;
     }
+    re->forward.unanchored = 1;
+    re->forward.order = REGEX_EARLIEST;
+    re->reverse.start = re->backward.start;
+    re->backward.unanchored = 1;
+    re->latest.start = re->forward.start;
+    re->latest.unanchored = 1;
+    re->latest.order = REGEX_LATEST;
+    re->list = malloc(re->node_count * sizeof(*re->list));
+    re->stack = malloc(re->node_count * sizeof(*re->stack));
+    re->mark = calloc(re->node_count, sizeof(*re->mark));
+    if (re->list == NULL || re->stack == NULL || re->mark == NULL)
+    {
+        p.error = "Out of memory.";
+        goto error;
+    }
+    return 1;
 error:
-    buffer_destroy(b);
+    regex_destroy(re);
+    *error = p.error;
     return 0;
 }
 
-unsigned char* buffer_access(struct buffer* b, offset_t offset, size_t size)
+// Starts a new set of nodes for a state.
+static void regex_unmark(struct regex* re)
 {
-    if (size > b->size)
+    if (++re->generation == 0)
     {
-        return NULL;
+        memset(re->mark, 0, re->node_count * sizeof(*re->mark));
+        re->generation = 1;
     }
-    if (offset >= b->filesize)
+}
+
+// Adds node, and the nodes it leads to without taking a byte, to the list
+// of *count.
+static void regex_closure(struct regex* re, int node, size_t* count)
+{
+    size_t depth = 0;
+    const struct regex_node* n;
+
+    if (re->mark[node] == re->generation)
     {
-        return NULL;
+        return;
     }
-    if (!b->valid || offset < b->offset || offset + size > b->offset + b->size)
+    re->mark[node] = re->generation;
+    re->stack[depth++] = node;
+    while (depth > 0)
     {
-        if (!b->valid)
-        {
-            b->offset = offset;
-        }
-        else if (offset < b->offset)
+        n = &re->nodes[node = re->stack[--depth]];
+        if (n->kind != REGEX_SPLIT)
         {
-            if (offset + size > b->size)
-            {
-                b->offset = offset + size - b->size;
-            }
-            else
-            {
-                b->offset = 0;
-            }
+            re->list[(*count)++] = node;
         }
-        else // offset+size > b->offset+b->size
+        else
         {
-            if (offset + b->size > b->filesize)
+            if (re->mark[n->out] != re->generation)
             {
-                b->offset = b->filesize - b->size;
+                re->mark[n->out] = re->generation;
+                re->stack[depth++] = n->out;
             }
-            else
+            if (re->mark[n->out1] != re->generation)
             {
-                b->offset = offset;
+                re->mark[n->out1] = re->generation;
+                re->stack[depth++] = n->out1;
             }
         }
-        fseek(b->file, b->offset, SEEK_SET);
-        if (fread(b->buffer,
-                  min(b->size, b->filesize - b->offset),
-                  1,
-                  b->file) != 1)
-        {
-            return NULL;
-        }
-        b->valid = 1;
     }
-    return &b->buffer[offset - b->offset];
 }
 
-enum buffer_search_direction
+static int compare_ints(const void* a, const void* b)
 {
-    BUFFER_FORWARD,
-    BUFFER_BACKWARD
-};
+    int x = *(const int*)a;
+    int y = *(const int*)b;
 
-int buffer_search(struct buffer* b, offset_t offset, size_t search_length,
-        unsigned char* search_target, enum buffer_search_direction d,
-        offset_t* match_offset)
+    return x < y ? -1 : x > y;
+}
+
+// Returns the state of the count nodes in re->list, which is added where
+// it is new; -1 where memory runs out.
+static int regex_state(struct regex* re, struct regex_dfa* dfa, size_t count,
+        int open)
 {
-    size_t match_block_size = min(search_length, b->size);
-    offset_t fo;
-    offset_t mo;
+    struct regex_state* s;
+    unsigned long hash = 2 * count + open;
+    size_t slot;
+    size_t i;
 
-    if (search_length == 0)
+    if (dfa->order == REGEX_SET)
     {
-        return 0;
+        qsort(re->list, count, sizeof(*re->list), compare_ints);
+    }
+    for (i = 0; i < count; i++)
+    {
+        hash = hash * 31 + re->list[i];
+    }
+    if (dfa->table == NULL
+        && (dfa->table = calloc(2 * REGEX_STATES, sizeof(*dfa->table)))
+            == NULL)
+    {
+        return -1;
     }
-    for (
-        fo = offset;
-        fo < b->filesize - search_length;
-        (d == BUFFER_FORWARD) ? fo++ : fo--)
+    for (slot = hash % (2 * REGEX_STATES); dfa->table[slot] != 0;
+         slot = (slot + 1) % (2 * REGEX_STATES))
     {
-        mo = 0;
-        for (mo = 0; mo < search_length; mo += match_block_size)
+        s = &dfa->states[dfa->table[slot] - 1];
+        if (s->hash == hash
+            && s->count == count
+            && s->open == open
+            && memcmp(&dfa->pool[s->first], re->list,
+                      count * sizeof(*re->list)) == 0)
         {
-            unsigned char* page = buffer_access(b, fo, match_block_size);
-            if (memcmp(page,
-                       &search_target[mo],
-                       min(search_length - mo, match_block_size)) != 0)
-            {
-                break;
-            }
+            return dfa->table[slot] - 1;
         }
-        if (mo >= search_length)
+    }
+    if (dfa->state_count == REGEX_STATES)
+    {
+        // Full: start over.
+        dfa->state_count = 0;
+        dfa->pool_length = 0;
+        dfa->flushes++;
+        memset(dfa->table, 0, 2 * REGEX_STATES * sizeof(*dfa->table));
+    }
+    if (dfa->state_count == dfa->state_capacity)
+    {
+        size_t capacity = max(2 * dfa->state_capacity, 16);
+        s = realloc(dfa->states, capacity * sizeof(*s));
+        if (s == NULL)
         {
-            *match_offset = fo;
-            return 1;
+            return -1;
         }
-        if (d == BUFFER_BACKWARD && fo == 0)
+        dfa->states = s;
+        dfa->state_capacity = capacity;
+    }
+    if (count > dfa->pool_capacity - dfa->pool_length)
+    {
+        size_t capacity = max(2 * dfa->pool_capacity,
+                              dfa->pool_length + count);
+        int* pool = realloc(dfa->pool, capacity * sizeof(*pool));
+        if (pool == NULL)
         {
-            break;
+            return -1;
         }
+        dfa->pool = pool;
+        dfa->pool_capacity = capacity;
     }
-    return 0;
+    s = &dfa->states[dfa->state_count];
+    for (i = 0; i < 256; i++)
+    {
+        s->next[i] = -1;
+    }
+    s->first = dfa->pool_length;
+    s->count = count;
+    s->hash = hash;
+    s->open = open;
+    s->accept = 0;
+    for (i = 0; i < count; i++)
+    {
+        s->accept |= re->nodes[re->list[i]].kind == REGEX_MATCH;
+    }
+    s->final = !open
+        && (count == 0
+            || (dfa->order != REGEX_SET
+                && re->nodes[re->list[0]].kind == REGEX_MATCH));
+    memcpy(&dfa->pool[s->first], re->list, count * sizeof(*re->list));
+    dfa->pool_length += count;
+    for (slot = hash % (2 * REGEX_STATES); dfa->table[slot] != 0;
+         slot = (slot + 1) % (2 * REGEX_STATES))
+    {
+    }
+    dfa->table[slot] = (int)++dfa->state_count;
+    return (int)dfa->state_count - 1;
 }
 
-void buffer_invalidate(struct buffer* b)
+static int regex_start(struct regex* re, struct regex_dfa* dfa)
 {
-    b->valid = 0;
+    size_t count = 0;
+
+    regex_unmark(re);
+    regex_closure(re, dfa->start, &count);
+    return regex_state(re, dfa, count, dfa->unanchored);
 }
 
-int buffer_write(struct buffer* b, size_t offset, size_t size,
-        unsigned char* data)
+// Returns state with no more matches starting; -1 where memory runs out.
+static int regex_close(struct regex* re, struct regex_dfa* dfa, int state)
 {
-    if (fseek(b->file, offset, SEEK_SET) != 0)
+    const struct regex_state* s = &dfa->states[state];
+
+    if (!s->open)
     {
-        return 0;
+        return state;
     }
-    // Not updating b->offset here, because the data in b->buffer is
-    // still from the original b->offset.
-    if (fwrite(data, size, 1, b->file) != 1)
+    memcpy(re->list, &dfa->pool[s->first], s->count * sizeof(*re->list));
+    return regex_state(re, dfa, s->count, 0);
+}
+
+// Works out where byte c leads from state; -1 where memory runs out.
+static int regex_step(struct regex* re, struct regex_dfa* dfa, int state,
+        int c)
+{
+    const struct regex_state* s = &dfa->states[state];
+    const struct regex_node* n;
+    unsigned long flushes = dfa->flushes;
+    int open = s->open;
+    size_t count = 0;
+    size_t i;
+    int next;
+
+    regex_unmark(re);
+    if (open && dfa->order == REGEX_LATEST)
     {
-        return 0;
+        regex_closure(re, dfa->start, &count);
     }
-    // Re-read b->buffer if changed on disk:
-    if ((offset < b->offset + b->size) && (offset + size >= b->offset))
+    for (i = 0; i < s->count; i++)
     {
-        if (fseek(b->file, b->offset, SEEK_SET) != 0)
+        n = &re->nodes[dfa->pool[s->first + i]];
+        if (n->kind == REGEX_BYTES
+            && (re->tree[n->tree].set[c / 8] >> (c % 8)) & 1)
         {
-            return 0;
+            regex_closure(re, n->out, &count);
         }
-        if (fread(b->buffer,
-                  min(b->size, b->filesize - b->offset),
-                  1,
-                  b->file) != 1)
+    }
+    if (open && dfa->order != REGEX_LATEST)
+    {
+        regex_closure(re, dfa->start, &count);
+    }
+    if (dfa->order != REGEX_SET)
+    {
+        for (i = 0; i < count; i++)
         {
-            return 0;
+            if (re->nodes[re->list[i]].kind == REGEX_MATCH)
+            {
+                // Matches that start later cannot come first anymore:
+                count = i + 1;
+                open &= dfa->order == REGEX_LATEST;
+                break;
+            }
         }
     }
-    return 1;
+    next = regex_state(re, dfa, count, open);
+    // Unless that dropped all the states, state among them:
+    if (next >= 0 && dfa->flushes == flushes)
+    {
+        dfa->states[state].next[c] = next;
+    }
+    return next;
 }
 
-int buffer_insert(struct buffer* b, offset_t offset, size_t size)
+// Runs the DFA from *state over text, or backwards, until it accepts or
+// nothing better can come. Returns the bytes taken; *state is -1 where
+// memory ran out.
+static size_t regex_run(struct regex* re, struct regex_dfa* dfa,
+        int* state, const unsigned char* text, size_t size, int backwards)
 {
-    unsigned char* buffer = NULL;
-    offset_t tailsize;
-    offset_t o;
+    int current = *state;
+    int next;
+    size_t i = 0;
+    int c;
 
-    offset = min(offset, b->filesize);
-    size = min(size, ~(size_t)0 - b->filesize);
-    tailsize = b->filesize - offset;
+    while (i < size)
+    {
+        c = backwards ? text[size - 1 - i] : text[i];
+        i++;
+        if ((next = dfa->states[current].next[c]) < 0
+            && (next = regex_step(re, dfa, current, c)) < 0)
+        {
+            current = -1;
+            break;
+        }
+        current = next;
+        if (dfa->states[current].accept || dfa->states[current].final)
+        {
+            break;
+        }
+    }
+    *state = current;
+    return i;
+}
 
-    // Append to file:
-    buffer_invalidate(b);
-    memset(b->buffer, 0, b->size);
-    b->filesize += size;
-    for (o = 0; o < size; o += b->size)
+// Tells whether the DFA stays in state over zeros without accepting, so
+// that holes can be passed over. Only known once it has read a zero there.
+static int regex_idle(const struct regex_dfa* dfa, int state)
+{
+    return dfa->states[state].next[0] == state
+        && !dfa->states[state].accept;
+}
+
+// Finds the match that starts first from offset on, or backwards, last at
+// offset or before.
+int buffer_regex_search(struct buffer* b, offset_t offset, struct regex* re,
+        enum buffer_search_direction d, offset_t* match_offset)
+{
+    struct regex_dfa* dfa = &re->forward;
+    struct scan scan;
+    unsigned char* data;
+    size_t size;
+    size_t n;
+    offset_t from = offset;     // Where the match can start,
+    offset_t last = b->length;  // up to here,
+    offset_t stop = b->length;  // and from where none starts anymore.
+    offset_t match_end = 0;
+    offset_t limit;
+    offset_t at;
+    offset_t end;
+    int state = 0;
+    int found = 0;
+
+    if (re->nodes == NULL || b->length == 0)
     {
-        size_t chunksize = min(size - o, b->size);
-        if (buffer_write(b, b->filesize + o - size, chunksize, b->buffer) == 0)
+        return 0;
+    }
+    scan.data = b->backend == BUFFER_READ
+        ? io_alloc(b->io, BUFFER_MOVE_SIZE)
+        : NULL;
+    scan.offset = 0;
+    scan.length = 0;
+    buffer_scan_begin(b);
+    if (d == BUFFER_BACKWARD)
+    {
+        // The last match that ends by then starts where the one to find
+        // does at the earliest:
+        last = min(offset, b->length - 1);
+        from = 0;
+        dfa = &re->backward;
+        state = regex_start(re, dfa);
+        for (at = last + 1; state >= 0 && at > 0; at -= n)
         {
-            return 0;
+            if (regex_idle(dfa, state) && buffer_hole(b, at - 1, &end))
+            {
+                n = (size_t)min(at - buffer_hole_start(b, at - 1),
+                                (size_t)-1);
+                continue;
+            }
+            if ((data = buffer_block(b, &scan, at - 1, 1, &size)) == NULL)
+            {
+                break;
+            }
+            n = regex_run(re, dfa, &state, data, size, 1);
+            if (state >= 0 && dfa->states[state].accept)
+            {
+                from = at - n;
+                break;
+            }
         }
+        dfa = &re->latest;
+        stop = last;
     }
-    // Move trailing part towards back:
-    for (o = 0; o < tailsize; o += b->size)
+    // Forward to where that match ends:
+    state = state >= 0 ? regex_start(re, dfa) : -1;
+    for (at = from; state >= 0 && at < b->length; at += n)
     {
-        size_t chunksize = min(tailsize - o, b->size);
-        if ((buffer = buffer_access(b,
-                                    b->filesize - (size + o + chunksize),
-                                    chunksize)) == NULL)
+        if (at == stop && (state = regex_close(re, dfa, state)) < 0)
         {
-            return 0;
+            break;
         }
-        if (buffer_write(b,
-                         b->filesize - (o + chunksize),
-                         chunksize,
-                         b->buffer) == 0)
+        limit = dfa->states[state].open ? stop : b->length;
+        if (regex_idle(dfa, state) && buffer_hole(b, at, &end))
         {
-            return 0;
+            n = (size_t)min(min(end, limit) - at, (size_t)-1);
+            continue;
+        }
+        if ((data = buffer_block(b, &scan, at, 0, &size)) == NULL)
+        {
+            break;
+        }
+        n = regex_run(re, dfa, &state, data, (size_t)min(size, limit - at),
+                      0);
+        if (state >= 0 && dfa->states[state].accept)
+        {
+            match_end = at + n;
+            found = 1;
+        }
+        if (state < 0 || dfa->states[state].final)
+        {
+            break;
         }
     }
-    // Initialize the inserted bytes:
-    for (o = 0; o < size; o += b->size)
+    // and back from there to where it starts:
+    dfa = &re->reverse;
+    state = found && state >= 0 ? regex_start(re, dfa) : -1;
+    found = 0;
+    for (at = match_end; state >= 0 && at > from; at -= n)
     {
-        size_t chunksize = min(size - o, b->size);
-        buffer_invalidate(b);
-        memset(b->buffer, 0, chunksize);
-        if (buffer_write(b, offset + o, chunksize, b->buffer) == 0)
+        if ((data = buffer_block(b, &scan, at - 1, 1, &size)) == NULL)
         {
-            return 0;
+            break;
+        }
+        n = (size_t)min(size, at - from);
+        n = regex_run(re, dfa, &state, &data[size - n], n, 1);
+        if (state < 0)
+        {
+            break;
+        }
+        if (dfa->states[state].accept && at - n <= last)
+        {
+            *match_offset = at - n;
+            found = 1;
+            if (d == BUFFER_BACKWARD)
+            {
+                break;
+            }
+        }
+        if (dfa->states[state].final)
+        {
+            break;
         }
     }
+    buffer_scan_end(b);
+    free(scan.data);
+    return found;
+}
+
+#if defined(HAVE_BRACKETED_PASTE)
+#if defined(HAVE_SSE2)
+// Decodes 16 hex digits into 8 bytes, unless some are not hex digits.
+static int hex_decode16(const char* text, unsigned char* data)
+{
+    __m128i c = _mm_loadu_si128((const __m128i*)text);
+    __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i letter = _mm_and_si128(
+        _mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+        _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+    __m128i nibbles;
+    __m128i bytes;
+
+    if (_mm_movemask_epi8(_mm_or_si128(digit, letter)) != 0xFFFF)
+    {
+        return 0;
+    }
+    nibbles = _mm_or_si128(
+        _mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+        _mm_andnot_si128(digit, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+    // The first digit of each pair is the low byte of a 16 bit lane:
+    bytes = _mm_or_si128(
+        _mm_slli_epi16(_mm_and_si128(nibbles, _mm_set1_epi16(0x00FF)), 4),
+        _mm_srli_epi16(nibbles, 8));
+    _mm_storel_epi64((__m128i*)data, _mm_packus_epi16(bytes, bytes));
     return 1;
 }
+#endif
 
-int buffer_remove(struct buffer* b, offset_t offset, size_t size)
+// Appends the bytes of hex digits to data, skipping whitespace. A digit
+// left over waits in *half, -1 for none. Returns 0 at anything else.
+static int hex_decode_span(const char* text, size_t length,
+        unsigned char* data, size_t* size, int* half)
 {
-    offset_t o;
+    size_t i = 0;
 
-    offset = min(offset, b->filesize);
-    size = min(size, b->filesize - offset);
-    for (o = offset + size; o < b->filesize; o += b->size)
+    while (i < length)
     {
-        size_t chunksize = min(b->size, b->filesize - o);
-        unsigned char* buffer = NULL;
-        if ((buffer = buffer_access(b, o, chunksize)) == NULL)
+        int c;
+#if defined(HAVE_SSE2)
+        // Runs of digits go 16 at a time:
+        if (*half < 0
+            && length - i >= 16
+            && hex_decode16(&text[i], &data[*size]))
         {
-            return 0;
+            i += 16;
+            *size += 8;
+            continue;
+        }
+#endif
+        c = (unsigned char)text[i++];
+        if (isspace(c))
+        {
+            continue;
         }
-        if (buffer_write(b, o - size, chunksize, buffer) == 0)
+        if (!is_hex(c))
         {
             return 0;
         }
+        if (*half < 0)
+        {
+            *half = hex_char_to_nibble(c);
+        }
+        else
+        {
+            data[(*size)++] =
+                (unsigned char)(*half << 4 | hex_char_to_nibble(c));
+            *half = -1;
+        }
     }
-    b->filesize -= size;
-#if defined(__DOS__)
-    (void)!chsize(fileno(b->file), b->filesize);
-#elif defined(WIN32)
-    (void)!_chsize(_fileno(b->file), b->filesize);
-#else
-    (void)!ftruncate(fileno(b->file), b->filesize);
-#endif
     return 1;
 }
 
-static int is_hex(int c)
-{
-    return ((c >= '0') && (c <= '9'))
-        || ((c >= 'A') && (c <= 'F'))
-        || ((c >= 'a') && (c <= 'f'));
-}
-
-static int is_printable_ascii(int c)
+// Decodes pasted hex, also dumps of xxd, hexdump -C and this editor less
+// their offsets and ASCII columns. Returns 0 unless that is whole bytes.
+static int hex_decode(const char* text, size_t length, unsigned char* data,
+        size_t* size)
 {
-    return (c >= ' ') && (c <= '~');
-}
+    const char* end = text + length;
+    int half = -1;
+    int bars = 0;
 
-static int hex_char_to_nibble(int c)
-{
-    if (is_hex(c))
+    *size = 0;
+    while (text < end)
     {
-        int nibble = c - '0';
-        if (nibble > 9)
+        const char* line_end = memchr(text, '\n', end - text);
+        const char* bar;
+        const char* digits;
+        int xxd;
+
+        line_end = line_end != NULL ? line_end : end;
+        bar = memchr(text, '|', line_end - text);
+        for (digits = text; digits < line_end && is_hex(*digits); digits++)
         {
-            nibble -= 'A' - '9' - 1;
         }
-        if (nibble > 15)
+        xxd = digits > text && digits < line_end && *digits == ':';
+        if (xxd
+            || (bar != NULL && digits > text && isspace(*digits))
+            || (bars && digits == line_end && digits > text))
         {
-            nibble -= 'a' - 'A';
+            // An offset, or the last line of a dump giving the end:
+            text = xxd ? digits + 1 : digits;
         }
-        return nibble;
+        if (xxd)
+        {
+            // The ASCII column of xxd follows two spaces, and may have
+            // bars of its own:
+            const char* column;
+
+            for (column = text; column + 1 < line_end; column++)
+            {
+                if (column[0] == ' ' && column[1] == ' ')
+                {
+                    line_end = column;
+                    break;
+                }
+            }
+        }
+        else if (bar != NULL)
+        {
+            bars = 1;
+            line_end = bar;
+        }
+        if (!hex_decode_span(text, line_end - text, data, size, &half))
+        {
+            return 0;
+        }
+        text = memchr(line_end, '\n', end - line_end);
+        text = text != NULL ? text + 1 : end;
     }
-    return 0;
+    return half < 0;
 }
+#endif
 
 static int ascii_x_pos(int offset)
 {
@@ -354,10 +6513,27 @@ static int hex_y_pos(int offset)
     return offset / 16;
 }
 
-static void display_contents(offset_t size, offset_t offset,
-        unsigned char* page, int lines)
+// The offset column is as wide as the largest offset in the file needs,
+// and at least eight digits.
+static int offset_width(offset_t size)
+{
+    int width = 8;
+
+    for (size >>= 4 * width; size > 0; size >>= 4)
+    {
+        width++;
+    }
+    return width;
+}
+
+// Bytes from select_start up to select_end show highlighted.
+static void display_contents(struct buffer* b, offset_t offset, int lines,
+        offset_t select_start, offset_t select_end)
 {
+    offset_t size = b->length;
     offset_t o = 0;
+    int width = offset_width(size);
+    int x = width + 2;
     int y;
     int i;
 
@@ -365,53 +6541,83 @@ static void display_contents(offset_t size, offset_t offset,
     {
         if (offset + o < size)
         {
-#if defined(__DOS__)
-            mvprintw(y, 0, "%08lX", offset + o);
-#else
-            mvprintw(y, 0, "%08zX", offset + o);
-#endif
+            offset_t hole_end;
+            // Rows within a hole of a sparse file are all zeros and need
+            // not be read, they show dimmed:
+            int hole = buffer_hole(b, offset + o, &hole_end)
+                && hole_end >= min(offset + o + 16, size);
+            // Rows whose data is still being read show as placeholders
+            // until it lands.
+            unsigned char* row = hole ? NULL : buffer_peek(b, offset + o, 16);
+
+            mvprintw(y, 0, "%0*" OFFSET_FORMAT, width, offset + o);
 
             for (i = 0; i < 16; i++)
             {
                 if (offset + o < size)
                 {
-                    unsigned char byte = page[o];
+                    int selected = offset + o >= select_start
+                        && offset + o < select_end;
+
+                    if (selected)
+                    {
+                        attron(A_REVERSE);
+                    }
+                    if (hole)
+                    {
+                        attron(A_DIM);
+                        mvaddstr(hex_y_pos(o), x + hex_x_pos(o), "00");
+                        mvaddch(ascii_y_pos(o), x + 51 + ascii_x_pos(o), '.');
+                        attroff(A_DIM);
+                    }
+                    else if (row != NULL)
+                    {
+                        unsigned char byte = row[i];
 
-                    mvprintw(hex_y_pos(o), 10 + hex_x_pos(o), "%02X", byte);
-                    mvaddch(ascii_y_pos(o), 61 + ascii_x_pos(o),
-                        isprint(byte) ? byte : '.');
+                        mvprintw(hex_y_pos(o), x + hex_x_pos(o), "%02X",
+                            byte);
+                        mvaddch(ascii_y_pos(o), x + 51 + ascii_x_pos(o),
+                            isprint(byte) ? byte : '.');
+                    }
+                    else
+                    {
+                        mvaddstr(hex_y_pos(o), x + hex_x_pos(o), "..");
+                        mvaddch(ascii_y_pos(o), x + 51 + ascii_x_pos(o), ' ');
+                    }
+                    if (selected)
+                    {
+                        attroff(A_REVERSE);
+                    }
                     ++o;
                 }
             }
 
-            mvaddch(y, 60, '|');
-            mvaddch(y, 62 + ((o - 1) % 16), '|');
+            mvaddch(y, x + 50, '|');
+            mvaddch(y, x + 52 + ((o - 1) % 16), '|');
         }
         else
         {
-#if defined(__DOS__)
-            mvprintw(y, 0, "%08lX", size);
-#else
-            mvprintw(y, 0, "%08zX", size);
-#endif
+            mvprintw(y, 0, "%0*" OFFSET_FORMAT, width, size);
             break;
         }
     }
 }
 
-static void set_cursor(enum edit_mode edit_mode, offset_t offset,
-        offset_t cursor)
+static void set_cursor(struct buffer* b, enum edit_mode edit_mode,
+        offset_t offset, offset_t cursor, int nibble)
 {
+    int x = offset_width(b->length) + 2;
+
     switch (edit_mode)
     {
         case HEX:
-            move(0 + hex_y_pos(cursor / 2 - offset),
-                 10 + hex_x_pos(cursor / 2 - offset) + cursor % 2);
+            move(0 + hex_y_pos(cursor - offset),
+                 x + hex_x_pos(cursor - offset) + nibble);
             break;
 
         case ASCII:
-            move(0 + ascii_y_pos(cursor / 2 - offset),
-                 61 + ascii_x_pos(cursor / 2 - offset));
+            move(0 + ascii_y_pos(cursor - offset),
+                 x + 51 + ascii_x_pos(cursor - offset));
             break;
     }
 }
@@ -502,7 +6708,7 @@ static int get_number(const char* prompt, offset_t* number, int hex)
             case KEY_ENTER:
             case 10:
             case 13:
-                *number = strtoul(numstr, NULL, hex ? 16 : 10);
+                *number = strtooffset(numstr, NULL, hex ? 16 : 10);
                 delwin(win);
                 return 1;
         }
@@ -514,21 +6720,33 @@ static int get_number(const char* prompt, offset_t* number, int hex)
     return 0;
 }
 
+static const char* get_data_mode(int hex, int regex)
+{
+    return hex ? "(hex)  " : regex ? "(regex)" : "(ASCII)";
+}
+
+// Reads bytes typed in hex or ASCII. With mask, '?' stands for a nibble
+// that matches anything; with regex, the text can be an expression.
 static int get_data(const char* prompt, int max_length, unsigned char* target,
-        int* target_length, int hex)
+        unsigned char* mask, int* target_length, int hex, int* regex)
 {
     int pos = 0;
     int y;
     int key;
 
     WINDOW* win = newwin(3, COLS, (LINES - 3) / 2, 0);
+    if (regex != NULL && *regex)
+    {
+        hex = 0;
+    }
     wattron(win, A_REVERSE);
     for (y = 0; y < 3; y++)
     {
         mvwhline(win, y, 0, ' ', COLS);
     }
     mvwaddstr(win, 1, 1, prompt);
-    mvwaddstr(win, 1, 1 + strlen(prompt) + 1, hex ? "(hex)  " : "(ASCII)");
+    mvwaddstr(win, 1, 1 + strlen(prompt) + 1,
+              get_data_mode(hex, regex != NULL && *regex));
     wmove(win, 1, 1 + strlen(prompt) + 9);
 
     wrefresh(win);
@@ -553,14 +6771,36 @@ static int get_data(const char* prompt, int max_length, unsigned char* target,
             case KEY_RIGHT:
             case KEY_UP:
             case KEY_DOWN:
-                hex = !hex;
+                // hex, ASCII, then regex where it may be one:
+                if (regex != NULL && !hex && !*regex)
+                {
+                    *regex = 1;
+                }
+                else
+                {
+                    hex = !hex;
+                    if (regex != NULL)
+                    {
+                        *regex = 0;
+                    }
+                }
                 mvwaddstr(win, 1, 1 + strlen(prompt) + 1,
-                          hex ? "(hex)  " : "(ASCII)");
+                          get_data_mode(hex, regex != NULL && *regex));
                 break;
 
             case KEY_BACKSPACE:
             case 8:
-                if (pos > 0) target[--pos] = '\0';
+                if (pos > 0)
+                {
+                    // Back to the start of the byte, or of its low nibble:
+                    pos = hex ? pos - 1 : (pos - 1) & ~1;
+                    target[pos / 2] &= pos % 2 ? 0xF0 : 0;
+                    if (mask != NULL)
+                    {
+                        mask[pos / 2] |= 0x0F;
+                    }
+                    target[(pos + 1) / 2] = '\0';
+                }
                 break;
 
             case KEY_ENTER:
@@ -575,15 +6815,26 @@ static int get_data(const char* prompt, int max_length, unsigned char* target,
                 {
                   if (hex)
                   {
-                    if (is_hex(key))
+                    if (is_hex(key) || (key == '?' && mask != NULL))
                     {
+                      int nibble = key == '?' ? 0 : hex_char_to_nibble(key);
+                      int bits = key == '?' ? 0 : 0x0F;
+
                       if (pos % 2 == 0)
                       {
-                        target[pos / 2] = hex_char_to_nibble(key) << 4;
+                        target[pos / 2] = nibble << 4;
+                        if (mask != NULL)
+                        {
+                          mask[pos / 2] = (bits << 4) | 0x0F;
+                        }
                       }
                       else
                       {
-                        target[pos / 2] |= hex_char_to_nibble(key);
+                        target[pos / 2] |= nibble;
+                        if (mask != NULL)
+                        {
+                          mask[pos / 2] = (mask[pos / 2] & 0xF0) | bits;
+                        }
                       }
                       ++pos;
                     }
@@ -593,11 +6844,15 @@ static int get_data(const char* prompt, int max_length, unsigned char* target,
                     if (is_printable_ascii(key))
                     {
                       target[pos / 2] = key;
+                      if (mask != NULL)
+                      {
+                        mask[pos / 2] = 0xFF;
+                      }
                       pos += 2;
                       pos &= ~1;
                     }
                   }
-                  target[pos] = '\0';
+                  target[(pos + 1) / 2] = '\0';
                 }
                 break;
         }
@@ -607,8 +6862,18 @@ static int get_data(const char* prompt, int max_length, unsigned char* target,
             int i;
             for (i = 0; i < (pos + 1)/2; i++)
             {
-              mvwprintw(win, 1, 1 + strlen(prompt) + 9 + 2 * i, "%02X",
-                        target[i]);
+              char digits[3];
+
+              sprintf(digits, "%02X", target[i]);
+              if (mask != NULL && (mask[i] & 0xF0) == 0)
+              {
+                digits[0] = '?';
+              }
+              if (mask != NULL && (mask[i] & 0x0F) == 0)
+              {
+                digits[1] = '?';
+              }
+              mvwaddstr(win, 1, 1 + strlen(prompt) + 9 + 2 * i, digits);
             }
             wmove(win, 1, 1 + strlen(prompt) + 9 + pos);
         }
@@ -622,13 +6887,275 @@ static int get_data(const char* prompt, int max_length, unsigned char* target,
     return 0;
 }
 
+// Asks a yes or no question. Returns 'y', 'n' or KEY_ESC.
+static int get_answer(const char* prompt)
+{
+    int y;
+    int key;
+
+    WINDOW* win = newwin(3, COLS, (LINES - 3) / 2, 0);
+    wattron(win, A_REVERSE);
+    for (y = 0; y < 3; y++)
+    {
+        mvwhline(win, y, 0, ' ', COLS);
+    }
+    mvwaddstr(win, 1, 1, prompt);
+    mvwaddstr(win, 1, 1 + strlen(prompt) + 1, "(y/n)");
+
+    wrefresh(win);
+    keypad(win, TRUE);
+    for (key = 0; key != 'y' && key != 'n' && key != KEY_ESC;)
+    {
+        switch (key = wgetch(win))
+        {
+            case 'Y':
+                key = 'y';
+                break;
+
+            case 'N':
+                key = 'n';
+                break;
+
+            case KEY_CTRL('c'):
+                key = KEY_ESC;
+                break;
+
+            case KEY_RESIZE:
+                resize_term(0, 0);
+                break;
+        }
+    }
+    delwin(win);
+    return key;
+}
+
+// Shows a message until a key is pressed.
+static void show_message(const char* message)
+{
+    int y;
+
+    WINDOW* win = newwin(3, COLS, (LINES - 3) / 2, 0);
+    wattron(win, A_REVERSE);
+    for (y = 0; y < 3; y++)
+    {
+        mvwhline(win, y, 0, ' ', COLS);
+    }
+    mvwaddstr(win, 1, 1, message);
+    wrefresh(win);
+    wgetch(win);
+    delwin(win);
+}
+
+// Saves that move more than this many bytes show their progress.
+#define SAVE_PROGRESS_SIZE (16UL*1024*1024)
+
+static WINDOW* save_window = NULL;
+static int save_cancelled = 0;
+
+// Shows how far a save has got, and cancels it on Esc.
+static int save_progress(struct buffer* b, offset_t done, offset_t total)
+{
+    char text[64];
+    int y;
+
+    (void)b;
+    if (total < SAVE_PROGRESS_SIZE)
+    {
+        return 1;
+    }
+    if (save_window == NULL)
+    {
+        save_window = newwin(3, COLS, (LINES - 3) / 2, 0);
+        if (save_window == NULL)
+        {
+            return 1;
+        }
+        wattron(save_window, A_REVERSE);
+        keypad(save_window, TRUE);
+        nodelay(save_window, TRUE);
+    }
+    for (y = 0; y < 3; y++)
+    {
+        mvwhline(save_window, y, 0, ' ', COLS);
+    }
+    sprintf(text, "Saving... %d%% (Esc to cancel)",
+            (int)(done / (total / 100 + 1)));
+    mvwaddstr(save_window, 1, 1, text);
+    wrefresh(save_window);
+    switch (wgetch(save_window))
+    {
+        case KEY_ESC:
+        case KEY_CTRL('c'):
+            save_cancelled = 1;
+            return 0;
+    }
+    return 1;
+}
+
+static int save(struct buffer* b)
+{
+    int saved;
+
+    save_cancelled = 0;
+    b->progress = save_progress;
+    saved = buffer_save(b);
+    b->progress = NULL;
+    if (save_window != NULL)
+    {
+        delwin(save_window);
+        save_window = NULL;
+    }
+    if (saved)
+    {
+        return 1;
+    }
+    if (save_cancelled)
+    {
+        show_message(b->damaged
+                     ? "Save cancelled, the file is only partly written."
+                     : "Save cancelled.");
+    }
+    else
+    {
+        show_message(b->damaged
+                     ? "Could not save all changes, the file may be damaged."
+                     : "Could not save the changes.");
+    }
+    return 0;
+}
+
+#if defined(HAVE_BRACKETED_PASTE)
+// Takes in what the terminal pastes as a whole, and writes or inserts it at
+// the cursor in one go: as text in ASCII mode, decoded in hex mode.
+static void paste_text(struct buffer* b, offset_t* cursor, int* nibble,
+        enum edit_mode edit_mode, int insert)
+{
+    char* text = NULL;
+    unsigned char* data;
+    size_t length = 0;
+    size_t capacity = 0;
+    size_t size;
+    int key;
+
+    timeout(-1);
+    while ((key = getch()) != KEY_PASTE_END && key != ERR)
+    {
+        if (key > 0xFF)
+        {
+            continue;
+        }
+        if (length == capacity)
+        {
+            char* more = realloc(text, capacity = max(2 * capacity, 4096));
+            if (more == NULL)
+            {
+                show_message("Not enough memory for the pasted text.");
+                free(text);
+                return;
+            }
+            text = more;
+        }
+        // Terminals paste line breaks as returns:
+        text[length++] = (char)(key == '\r' ? '\n' : key);
+    }
+    if (length == 0)
+    {
+        return;
+    }
+    data = (unsigned char*)text;
+    size = length;
+    // Taken in also when it cannot be written, lest it be read as keys.
+    // Decoding in place writes behind where it reads.
+    if (b->io->readonly)
+    {
+        beep();
+    }
+    else if (edit_mode == HEX && !hex_decode(text, length, data, &size))
+    {
+        show_message("The pasted text is not hex.");
+    }
+    else if (insert ? buffer_insert_data(b, *cursor, size, data)
+                    : buffer_write(b, *cursor, size, data))
+    {
+        buffer_seal(b);
+        *cursor = min(*cursor + size, b->length);
+        *nibble = 0;
+    }
+    free(text);
+}
+#endif
+
+// Searches for the bytes, or where re is not NULL, for the expression.
+static int find(struct buffer* b, offset_t offset, size_t length,
+        const unsigned char* target, const unsigned char* mask,
+        struct regex* re, enum buffer_search_direction d,
+        offset_t* match_offset)
+{
+    return re != NULL ? buffer_regex_search(b, offset, re, d, match_offset)
+                      : buffer_search(b, offset, length, target, mask, d,
+                                      match_offset);
+}
+
+// Where no selection is being made.
+#define NO_MARK (~(offset_t)0)
+
+// The selection runs from the mark to the cursor, both included.
+static void get_selection(struct buffer* b, offset_t mark, offset_t cursor,
+        offset_t* start, offset_t* end)
+{
+    *start = 0;
+    *end = 0;
+    if (mark != NO_MARK)
+    {
+        *start = min(min(mark, cursor), b->length);
+        *end = min(max(mark, cursor) + 1, b->length);
+    }
+}
+
+// Tells whether the key would change the file.
+static int is_edit_key(int key, enum edit_mode edit_mode)
+{
+    switch (key)
+    {
+        case KEY_CTRL('a'):
+        case KEY_DC:
+        case KEY_BACKSPACE:
+        case 8:
+        case KEY_CTRL('x'):
+        case KEY_CTRL('v'):
+        case KEY_CTRL('e'):
+            return 1;
+    }
+    return edit_mode == HEX ? is_hex(key) : is_printable_ascii(key);
+}
+
 static void handle_keyboard(int* key, struct buffer* b, offset_t* offset,
-        offset_t* cursor, enum edit_mode* edit_mode)
+        offset_t* cursor, int* nibble, enum edit_mode* edit_mode,
+        offset_t* mark, int* insert)
 {
     static unsigned char search_buffer[64];
+    static unsigned char search_mask[64];
     static int search_len = -1;
+    static struct regex search_regex;
+    static int search_is_regex = 0;
+    const char* error;
+    static unsigned char fill_buffer[64];
+    int fill_len;
+    offset_t select_start;
+    offset_t select_end;
     *key = getch();
 
+    if (b->io->readonly && is_edit_key(*key, *edit_mode))
+    {
+        beep();
+        return;
+    }
+    // A run of typing is undone in one step, anything else ends it:
+    if (*key != ERR
+        && !(*edit_mode == HEX ? is_hex(*key) : is_printable_ascii(*key)))
+    {
+        buffer_seal(b);
+    }
     switch (*key)
     {
         case 0: // IGNORE
@@ -637,6 +7164,40 @@ static void handle_keyboard(int* key, struct buffer* b, offset_t* offset,
         case KEY_ESC: // TERMINATE
         case KEY_CTRL('c'):
             *key = KEY_ESC;
+            if (b->modified)
+            {
+                switch (get_answer("Save changes?"))
+                {
+                    case 'y':
+                        if (!save(b))
+                        {
+                            *key = 0;
+                        }
+                        break;
+
+                    case KEY_ESC:
+                        *key = 0;
+                        break;
+                }
+            }
+            break;
+
+        case KEY_CTRL('w'): // SAVE
+            save(b);
+            break;
+
+        case KEY_CTRL('u'): // UNDO
+            if (buffer_undo(b, cursor))
+            {
+                *nibble = 0;
+            }
+            break;
+
+        case KEY_CTRL('r'): // REDO
+            if (buffer_redo(b, cursor))
+            {
+                *nibble = 0;
+            }
             break;
 
         case KEY_RESIZE: // TERMINAL RESIZED
@@ -653,87 +7214,110 @@ static void handle_keyboard(int* key, struct buffer* b, offset_t* offset,
                 offset_t gotooffset;
                 if (get_number("Go to offset:", &gotooffset, 1))
                 {
-                    *cursor = 2 * min(b->filesize, gotooffset);
+                    *cursor = min(b->length, gotooffset);
+                    *nibble = 0;
                 }
             }
             break;
 
         case KEY_HOME: // GO TO START
             *cursor = 0;
+            *nibble = 0;
             break;
 
         case KEY_PPAGE: // GO PAGE UP
             if (*offset >= 16U * LINES)
             {
                 *offset -= 16 * LINES;
-                *cursor = (*cursor - 2 * 16 * LINES) & ~1;
+                *cursor -= 16 * LINES;
             }
             else
             {
                 *offset = 0;
-                *cursor = (*cursor % 16 * LINES) & ~1;
+                *cursor %= 16;
             }
+            *nibble = 0;
             break;
 
         case KEY_UP: // GO LINE UP
-            if (*cursor / 2 >= 16)
+            if (*cursor >= 16)
             {
-                *cursor = (*cursor - 2 * 16) & ~1;
+                *cursor -= 16;
+                *nibble = 0;
             }
             break;
 
         case KEY_LEFT: // GO BYTE UP
-            if (*cursor / 2 >= 1)
+            if (*cursor >= 1)
             {
-                *cursor = (*cursor - 2) & ~1;
+                --*cursor;
+                *nibble = 0;
             }
             break;
 
         case KEY_RIGHT: // GO BYTE DOWN
-            if (*cursor / 2 + 1 < b->filesize + 1)
+            if (*cursor + 1 < b->length + 1)
             {
-                *cursor = (*cursor + 2) & ~1;
+                ++*cursor;
+                *nibble = 0;
             }
             break;
 
         case KEY_DOWN: // GO LINE DOWN
-            if (*cursor / 2 + 16 < b->filesize + 1)
+            if (*cursor + 16 < b->length + 1)
             {
-                *cursor = (*cursor + 2 * 16) & ~1;
+                *cursor += 16;
+                *nibble = 0;
             }
             break;
 
         case KEY_NPAGE: // GO PAGE DOWN
-            if (*offset + 16 * LINES < b->filesize)
+            if (*offset + 16 * LINES < b->length)
             {
                 *offset += 16 * LINES;
-                if (*cursor / 2 + 16 * LINES < b->filesize + 1)
+                if (*cursor + 16 * LINES < b->length + 1)
                 {
-                    *cursor = (*cursor + 2 * 16 * LINES) & ~1;
+                    *cursor += 16 * LINES;
+                    *nibble = 0;
                 }
                 else
                 {
-                    *cursor = 2 * b->filesize - 1;
+                    *cursor = b->length - 1;
+                    *nibble = 1;
                 }
             }
             break;
 
         case KEY_END: // GO TO END
-            *offset = ((b->filesize - 1) / (16U * LINES)) * (16U * LINES);
-            *cursor = 2 * b->filesize;
+            *offset = ((b->length - 1) / (16U * LINES)) * (16U * LINES);
+            *cursor = b->length;
+            *nibble = 0;
             break;
 
         case KEY_CTRL('f'): // FIND
         case KEY_CTRL('s'): // SEARCH
             search_buffer[0] = '\0';
             if (get_data("Find data:", sizeof(search_buffer), search_buffer,
-                         &search_len, *edit_mode == HEX))
+                         search_mask, &search_len, *edit_mode == HEX,
+                         &search_is_regex))
             {
                 offset_t match_offset = 0;
-                if (buffer_search(b, *cursor/2, search_len, search_buffer,
-                                  BUFFER_FORWARD, &match_offset))
+                regex_destroy(&search_regex);
+                if (search_is_regex && search_len > 0
+                    && !regex_compile(&search_regex, search_buffer,
+                                      search_len, &error))
+                {
+                    show_message(error);
+                    search_len = 0;
+                }
+                else if (search_len > 0
+                         && find(b, *cursor, search_len, search_buffer,
+                                 search_mask, search_is_regex ? &search_regex
+                                                              : NULL,
+                                 BUFFER_FORWARD, &match_offset))
                 {
-                    *cursor = 2 * match_offset;
+                    *cursor = match_offset;
+                    *nibble = 0;
                 }
             }
             break;
@@ -742,32 +7326,52 @@ static void handle_keyboard(int* key, struct buffer* b, offset_t* offset,
             if (search_len > 0)
             {
                 offset_t match_offset = 0;
-                if (buffer_search(b, *cursor/2+1, search_len, search_buffer,
-                                  BUFFER_FORWARD, &match_offset))
+                if (find(b, *cursor + 1, search_len, search_buffer,
+                         search_mask, search_is_regex ? &search_regex : NULL,
+                         BUFFER_FORWARD, &match_offset))
                 {
-                    *cursor = 2 * match_offset;
+                    *cursor = match_offset;
+                    *nibble = 0;
                 }
             }
             break;
 
         case KEY_CTRL('p'): // PREVIOUS FIND/SEARCH MATCH
-            if (*cursor/2 > 0 && search_len > 0)
+            if (*cursor > 0 && search_len > 0)
             {
                 offset_t match_offset = 0;
-                if (buffer_search(b, *cursor/2-1, search_len, search_buffer,
-                                  BUFFER_BACKWARD, &match_offset))
+                if (find(b, *cursor - 1, search_len, search_buffer,
+                         search_mask, search_is_regex ? &search_regex : NULL,
+                         BUFFER_BACKWARD, &match_offset))
+                {
+                    *cursor = match_offset;
+                    *nibble = 0;
+                }
+            }
+            break;
+
+        case KEY_CTRL('d'): // GO TO NEXT DATA EXTENT
+            {
+                offset_t data_offset;
+                if (buffer_next_data(b, *cursor, &data_offset))
                 {
-                    *cursor = 2 * match_offset;
+                    *cursor = data_offset;
+                    *nibble = 0;
                 }
             }
             break;
 
-        case KEY_IC: // INSERT
+        case KEY_IC: // SWITCH INSERT/OVERWRITE
+            *insert = !*insert;
+            curs_set(*insert ? 1 : 2);
+            break;
+
+        case KEY_CTRL('a'): // INSERT ZEROS
             {
                 offset_t insertcount;
                 if (get_number("Number of bytes to insert:", &insertcount, 0))
                 {
-                    buffer_insert(b, *cursor / 2, insertcount);
+                    buffer_insert(b, *cursor, insertcount);
                 }
             }
             break;
@@ -777,8 +7381,56 @@ static void handle_keyboard(int* key, struct buffer* b, offset_t* offset,
                 offset_t removecount;
                 if (get_number("Number of bytes to remove:", &removecount, 0))
                 {
-                    buffer_remove(b, *cursor / 2, removecount);
+                    buffer_remove(b, *cursor, removecount);
+                }
+            }
+            break;
+
+#if defined(HAVE_BRACKETED_PASTE)
+        case KEY_PASTE_START: // PASTE FROM THE TERMINAL
+            paste_text(b, cursor, nibble, *edit_mode, *insert);
+            break;
+#endif
+
+        case KEY_CTRL('b'): // START/DROP SELECTION
+            *mark = *mark == NO_MARK ? *cursor : NO_MARK;
+            break;
+
+        case KEY_CTRL('k'): // COPY SELECTION
+        case KEY_CTRL('x'): // CUT SELECTION
+            get_selection(b, *mark, *cursor, &select_start, &select_end);
+            if (select_end > select_start
+                && buffer_copy(b, select_start, select_end - select_start))
+            {
+                if (*key == KEY_CTRL('x'))
+                {
+                    buffer_remove(b, select_start, select_end - select_start);
+                    *cursor = select_start;
+                    *nibble = 0;
+                }
+                *mark = NO_MARK;
+            }
+            break;
+
+        case KEY_CTRL('v'): // PASTE
+            buffer_paste(b, *cursor);
+            *nibble = 0;
+            break;
+
+        case KEY_CTRL('e'): // FILL SELECTION
+            get_selection(b, *mark, *cursor, &select_start, &select_end);
+            fill_buffer[0] = '\0';
+            if (select_end > select_start
+                && get_data("Fill with:", sizeof(fill_buffer), fill_buffer,
+                            NULL, &fill_len, *edit_mode == HEX, NULL)
+                && fill_len > 0)
+            {
+                if (!buffer_fill(b, select_start, select_end - select_start,
+                                 fill_buffer, fill_len))
+                {
+                    show_message("Could not fill the selection.");
                 }
+                *mark = NO_MARK;
             }
             break;
 
@@ -788,15 +7440,16 @@ static void handle_keyboard(int* key, struct buffer* b, offset_t* offset,
                 offset_t removecount;
                 if (get_number("Number of bytes to remove:", &removecount, 0))
                 {
-                    buffer_remove(b, *cursor / 2 - removecount, removecount);
-                    if (*cursor / 2 > removecount)
+                    buffer_remove(b, *cursor - removecount, removecount);
+                    if (*cursor > removecount)
                     {
-                        *cursor = (*cursor - 2 * removecount) & ~1;
+                        *cursor -= removecount;
                     }
                     else
                     {
                         *cursor = 0;
                     }
+                    *nibble = 0;
                 }
             }
             break;
@@ -807,65 +7460,108 @@ static void handle_keyboard(int* key, struct buffer* b, offset_t* offset,
         case HEX:
             if (is_hex(*key))
             {
-                int byte;
-                int nibble;
+                unsigned char* data;
+                unsigned char byte;
+                int value = hex_char_to_nibble(*key);
 
-                if (*cursor / 2 >= b->filesize)
-                {
-                    buffer_insert(b, b->filesize, 1);
-                }
-                byte = *buffer_access(b, *cursor / 2, 1);
-                nibble = hex_char_to_nibble(*key);
-                if (*cursor % 2 == 0)
+                // In insert mode and past the end the high digit starts a
+                // new byte:
+                if (!*nibble && (*insert || *cursor >= b->length))
                 {
-                    byte = (byte & 0x0F) | (nibble << 4);
+                    byte = (unsigned char)(value << 4);
+                    buffer_insert_data(b, *cursor, 1, &byte);
                 }
                 else
                 {
-                    byte = (byte & 0xF0) | nibble;
+                    if ((data = buffer_access(b, *cursor, 1)) == NULL)
+                    {
+                        break;
+                    }
+                    byte = *nibble
+                        ? (unsigned char)((*data & 0xF0) | value)
+                        : (unsigned char)((*data & 0x0F) | (value << 4));
+                    buffer_write(b, *cursor, 1, &byte);
                 }
-                buffer_write(b, *cursor / 2, 1, (unsigned char*)&byte);
-                ++*cursor;
+                *cursor += *nibble;
+                *nibble = !*nibble;
             }
             break;
 
         case ASCII:
             if (is_printable_ascii(*key))
             {
-                if (*cursor / 2 >= b->filesize)
+                unsigned char c = (unsigned char)*key;
+
+                if (*insert || *cursor >= b->length)
                 {
-                    buffer_insert(b, b->filesize, 1);
+                    buffer_insert_data(b, *cursor, 1, &c);
                 }
-                buffer_write(b, *cursor / 2, 1, (unsigned char*)key);
-                *cursor += 2;
+                else
+                {
+                    buffer_write(b, *cursor, 1, &c);
+                }
+                ++*cursor;
+                *nibble = 0;
             }
             break;
     }
-    while (*cursor/2 < *offset) *offset -= 16;
-    while (*cursor/2 > *offset + 16*(LINES-0) - 1) *offset += 16;
+    // Scroll the cursor into view, in whole lines:
+    if (*cursor < *offset)
+    {
+        *offset = *cursor - *cursor % 16;
+    }
+    if (*cursor > *offset + 16 * LINES - 1)
+    {
+        *offset = *cursor - *cursor % 16 - 16 * (LINES - 1);
+    }
 }
 
+// Milliseconds without a key after which the journal is synced.
+#define JOURNAL_SYNC_DELAY 300
+
 static void ui_loop(const char* srcname, struct buffer* b)
 {
     offset_t offset = 0;
     offset_t cursor = 0;
+    offset_t mark = NO_MARK;
+    offset_t select_start;
+    offset_t select_end;
+    int nibble = 0;
+    int insert = 0;
     enum edit_mode edit_mode = HEX;
     int key;
 
     (void)srcname;
     for (key = 0; key != KEY_ESC;)
     {
-        unsigned char* page = NULL;
+        buffer_poll(b);
+        if (cursor > b->length) // FILE TRUNCATED BEHIND OUR BACK
+        {
+            cursor = b->length;
+            nibble = 0;
+            offset = min(offset, b->length - b->length % 16);
+        }
 
-        page = buffer_access(b, offset, 16U*LINES);
+        buffer_readahead(b, offset, 16U*LINES);
 
         clear();
-        display_contents(b->filesize, offset, page, LINES);
-        set_cursor(edit_mode, offset, cursor);
+        get_selection(b, mark, cursor, &select_start, &select_end);
+        display_contents(b, offset, LINES, select_start, select_end);
+        set_cursor(b, edit_mode, offset, cursor, nibble);
         wnoutrefresh(stdscr);
         {
             doupdate();
-            handle_keyboard(&key, b, &offset, &cursor, &edit_mode);
+            // Wake up now and then to repaint rows whose data has landed,
+            // and once the user pauses to get the journal to the disk:
+            timeout(buffer_pending(b) ? 50
+                    : buffer_journal_pending(b) ? JOURNAL_SYNC_DELAY
+                    : -1);
+            handle_keyboard(&key, b, &offset, &cursor, &nibble, &edit_mode,
+                            &mark, &insert);
+            if (key == ERR)
+            {
+                buffer_journal_sync(b);
+            }
         }
     }
 }
@@ -874,56 +7570,133 @@ int main(int argc, char* argv[])
 {
     int retval = 0;
     const char* name = NULL;
-    FILE* file = NULL;
+    struct io io = IO_CLOSED;
+    int flags = 0;
+    int in_place = 0;
+    int threads = 1;
+    int recover;
     size_t buffersize = 4*1024;
+#if defined(HAVE_MMAP)
+    enum buffer_backend backend = BUFFER_MMAP;
+#else
+    enum buffer_backend backend = BUFFER_READ;
+#endif
     struct buffer b = {0};
+    int i;
 
+#if defined(HAVE_SEARCH_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+    threads = (int)max(sysconf(_SC_NPROCESSORS_ONLN), 1);
+#endif
     puts("Simple and portable hex editor."
          " Version " STR(VERSION_MAJOR) "." STR(VERSION_MINOR) "."
          STR(VERSION_REVISION) ".\n");
 
-    if (argc != 2)
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-s") == 0)
+        {
+            backend = BUFFER_READ;
+        }
+        else if (strcmp(argv[i], "-r") == 0)
+        {
+            flags |= IO_READONLY;
+        }
+        else if (strcmp(argv[i], "-i") == 0)
+        {
+            in_place = 1;
+        }
+        else if (strcmp(argv[i], "-d") == 0)
+        {
+            // Going around the system's cache rules out mapping:
+            flags |= IO_DIRECT;
+            backend = BUFFER_READ;
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc
+                 && (threads = atoi(argv[i + 1])) > 0)
+        {
+            i++;
+        }
+        else if (name == NULL && argv[i][0] != '-')
+        {
+            name = argv[i];
+        }
+        else
+        {
+            name = NULL;
+            break;
+        }
+    }
+    if (name == NULL)
     {
         fprintf(stderr,
           "Usage:\n"
-          "    %s <filename>\n",
+          "    %s [-s] [-r] [-d] [-i] [-j threads] <filename>\n"
+          "\n"
+          "    -s  Read into a page cache instead of memory mapping the file\n"
+          "    -r  Open read-only (also when the file cannot be written)\n"
+          "    -d  Bypass the system's cache for block devices (implies -s)\n"
+          "    -i  Save by rewriting the file in place instead of replacing it\n"
+          "    -j  Search with this many threads (default: one per processor)\n",
           argv[0]);
         retval = -1;
         goto cleanup;
     }
 
-    name = argv[1];
-    file = fopen(name, "r+b");
-    if (file == NULL)
+    if (!io_open(&io, name, flags))
     {
         fprintf(stderr, "Cannot open file: %s\n", name);
         retval = -1;
         goto cleanup;
     }
-    if (!buffer_create(&b, buffersize, file))
+    // Files that cannot be mapped (pipes, some devices) are read instead:
+    if (!buffer_create(&b, buffersize, &io, backend)
+        && (backend == BUFFER_READ
+            || !buffer_create(&b, buffersize, &io, BUFFER_READ)))
     {
         fputs("Could not create buffer.\n", stderr);
         retval = -2;
         goto cleanup;
     }
+    b.in_place = in_place;
+    b.threads = threads;
+    recover = buffer_journal_open(&b, name);
 
     initscr();
     cbreak();
     keypad(stdscr, TRUE);
     noecho();
     curs_set(2);
+#if defined(HAVE_BRACKETED_PASTE)
+    define_key("\033[200~", KEY_PASTE_START);
+    define_key("\033[201~", KEY_PASTE_END);
+    putp("\033[?2004h");
+    fflush(stdout);
+#endif
+
+    if (recover < 0)
+    {
+        show_message("Another instance journals this file, the changes"
+                     " here are not journaled.");
+    }
+    if (recover > 0)
+    {
+        buffer_journal_recover(&b, get_answer("Recover the unsaved changes"
+                                              " from the last session?")
+                                   == 'y');
+    }
 
     ui_loop(name, &b);
 
     move(0, 0);
     clear();
     refresh();
+#if defined(HAVE_BRACKETED_PASTE)
+    putp("\033[?2004l");
+    fflush(stdout);
+#endif
     endwin();
 cleanup:
     buffer_destroy(&b);
-    if (file != NULL)
-    {
-        fclose(file);
-    }
+    io_close(&io);
     return retval;
 }